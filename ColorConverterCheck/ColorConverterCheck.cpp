@@ -0,0 +1,225 @@
+// ColorConverterCheck.cpp : compares the conversions of ColorConverter with
+// those of sws_scale, for every format, matrix and range it takes. exits with
+// 1 when they differ by more than s_maxError on a component.
+//
+
+#include "ColorConverter.h"
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// the rounding of the last bit differs from sws
+static const int s_maxError = 1;
+// the exact path of libswscale. the default one is the x86 yuv2rgb, itself
+// up to 3 away from the exact conversion
+static const int s_swsFlags = SWS_BICUBIC | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT;
+// the chroma pairs tried, every STEP values of each component
+static const int STEP = 3;
+
+// odd width, so that the simd rows leave tails. the rows are padded like
+// those of decoded pictures, sws reads and writes past the width
+static const int WIDTH = 75;
+static const int HEIGHT = 6;
+static const int CHROMA_WIDTH = (WIDTH + 1) / 2;
+static const int CHROMA_HEIGHT = HEIGHT / 2;
+static const int ALIGN = 64;
+static const int DST_STRIDE = FFALIGN(4 * WIDTH, ALIGN);
+
+struct Picture
+{
+	Picture(AVPixelFormat format);
+
+	AVPixelFormat format;
+	std::vector<uint8_t> planes[3];
+	const uint8_t *data[4] = {};
+	int stride[4] = {};
+};
+
+Picture::Picture(AVPixelFormat format) :
+	format(format)
+{
+	bool semiPlanar = format == AV_PIX_FMT_NV12 || format == AV_PIX_FMT_NV21;
+	int nbPlanes = format == AV_PIX_FMT_PAL8 || semiPlanar ? 2 : 3;
+
+	stride[0] = FFALIGN(WIDTH, ALIGN);
+	for (int i = 1; i < nbPlanes; i++) {
+		stride[i] = format == AV_PIX_FMT_PAL8 ? 4 : FFALIGN(semiPlanar ? 2 * CHROMA_WIDTH : CHROMA_WIDTH, ALIGN);
+	}
+	for (int i = 0; i < nbPlanes; i++) {
+		planes[i].resize(format == AV_PIX_FMT_PAL8 && i ? 256 * 4 : stride[i] * (HEIGHT + 1));
+		data[i] = planes[i].data();
+	}
+}
+
+// the luma goes over the whole range, min to max
+static void fillLuma(Picture &pic, int min, int max)
+{
+	for (int i = 0; i < WIDTH * HEIGHT; i++) {
+		pic.planes[0][i / WIDTH * pic.stride[0] + i % WIDTH] = static_cast<uint8_t>(min + i % (max - min + 1));
+	}
+}
+
+static void setChroma(Picture &pic, int x, int y, int u, int v)
+{
+	switch (pic.format) {
+	case AV_PIX_FMT_NV12:
+		pic.planes[1][y * pic.stride[1] + 2 * x] = static_cast<uint8_t>(u);
+		pic.planes[1][y * pic.stride[1] + 2 * x + 1] = static_cast<uint8_t>(v);
+		break;
+	case AV_PIX_FMT_NV21:
+		pic.planes[1][y * pic.stride[1] + 2 * x] = static_cast<uint8_t>(v);
+		pic.planes[1][y * pic.stride[1] + 2 * x + 1] = static_cast<uint8_t>(u);
+		break;
+	default:
+		pic.planes[1][y * pic.stride[1] + x] = static_cast<uint8_t>(u);
+		pic.planes[2][y * pic.stride[2] + x] = static_cast<uint8_t>(v);
+		break;
+	}
+}
+
+static void convert(const Picture &pic, ColorConverter::Matrix matrix, bool fullRange, std::vector<uint8_t> &out)
+{
+	// in two calls, the second starting on an even row like the slices
+	ColorConverter::convert(pic.format, pic.data, pic.stride, WIDTH, 0, 2, out.data(), DST_STRIDE, matrix, fullRange);
+	ColorConverter::convert(pic.format, pic.data, pic.stride, WIDTH, 2, HEIGHT - 2, out.data(), DST_STRIDE, matrix, fullRange);
+}
+
+static int maxDifference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b)
+{
+	int maxError = 0;
+
+	for (int y = 0; y < HEIGHT; y++) {
+		for (int x = 0; x < 4 * WIDTH; x++) {
+			maxError = FFMAX(maxError, abs(a[y * DST_STRIDE + x] - b[y * DST_STRIDE + x]));
+		}
+	}
+	return maxError;
+}
+
+// the largest difference with sws over pictures of every chroma pair, each
+// of a single one, so that the way sws upsamples the chroma doesn't count.
+// limited range pictures keep to the legal values, which sws wraps past
+static int checkMatrix(AVPixelFormat format, ColorConverter::Matrix matrix, bool fullRange)
+{
+	int min = fullRange ? 0 : 16;
+	int lumaMax = fullRange ? 255 : 235;
+	int chromaMax = fullRange ? 255 : 240;
+	Picture pic(format);
+	std::vector<uint8_t> reference(DST_STRIDE * (HEIGHT + 1));
+	std::vector<uint8_t> converted(DST_STRIDE * (HEIGHT + 1));
+	uint8_t *dst[4] = { reference.data() };
+	int dstStride[4] = { DST_STRIDE };
+	int maxError = 0;
+
+	SwsContext *context = sws_getContext(WIDTH, HEIGHT, format, WIDTH, HEIGHT, AV_PIX_FMT_BGRA,
+		s_swsFlags, nullptr, nullptr, nullptr);
+	if (!context) {
+		return -1;
+	}
+	const int *coefficients = sws_getCoefficients(matrix == ColorConverter::MATRIX_BT709 ? SWS_CS_ITU709 : SWS_CS_ITU601);
+	sws_setColorspaceDetails(context, coefficients, fullRange, sws_getCoefficients(SWS_CS_DEFAULT), 1,
+		0, 1 << 16, 1 << 16);
+
+	fillLuma(pic, min, lumaMax);
+	for (int u = min; u <= chromaMax; u = u < chromaMax ? FFMIN(u + STEP, chromaMax) : u + 1) {
+		for (int v = min; v <= chromaMax; v = v < chromaMax ? FFMIN(v + STEP, chromaMax) : v + 1) {
+			for (int y = 0; y < CHROMA_HEIGHT; y++) {
+				for (int x = 0; x < CHROMA_WIDTH; x++) {
+					setChroma(pic, x, y, u, v);
+				}
+			}
+			sws_scale(context, pic.data, pic.stride, 0, HEIGHT, dst, dstStride);
+			convert(pic, matrix, fullRange, converted);
+			maxError = FFMAX(maxError, maxDifference(reference, converted));
+		}
+	}
+	sws_freeContext(context);
+	return maxError;
+}
+
+// the chroma of every 2x2 block apart: the interleaved layouts must give
+// the bytes of the planar one
+static int checkLayout(AVPixelFormat format)
+{
+	Picture planar(AV_PIX_FMT_YUV420P);
+	Picture pic(format);
+	std::vector<uint8_t> reference(DST_STRIDE * (HEIGHT + 1));
+	std::vector<uint8_t> converted(DST_STRIDE * (HEIGHT + 1));
+	unsigned seed = 1;
+
+	fillLuma(planar, 0, 255);
+	fillLuma(pic, 0, 255);
+	for (int y = 0; y < CHROMA_HEIGHT; y++) {
+		for (int x = 0; x < CHROMA_WIDTH; x++) {
+			seed = seed * 1103515245 + 12345;
+			setChroma(planar, x, y, (seed >> 16) & 0xff, seed >> 24);
+			setChroma(pic, x, y, (seed >> 16) & 0xff, seed >> 24);
+		}
+	}
+	convert(planar, ColorConverter::MATRIX_BT601, false, reference);
+	convert(pic, ColorConverter::MATRIX_BT601, false, converted);
+	return maxDifference(reference, converted);
+}
+
+// palettes are copied, sws gives the same bytes
+static int checkPalette()
+{
+	Picture pic(AV_PIX_FMT_PAL8);
+	std::vector<uint8_t> reference(DST_STRIDE * (HEIGHT + 1));
+	std::vector<uint8_t> converted(DST_STRIDE * (HEIGHT + 1));
+	uint8_t *dst[4] = { reference.data() };
+	int dstStride[4] = { DST_STRIDE };
+
+	fillLuma(pic, 0, 255);
+	for (int i = 0; i < 256; i++) {
+		uint32_t color = 0xff000000 | (i * 0x010307 & 0xffffff);
+		memcpy(&pic.planes[1][4 * i], &color, 4);
+	}
+	SwsContext *context = sws_getContext(WIDTH, HEIGHT, AV_PIX_FMT_PAL8, WIDTH, HEIGHT, AV_PIX_FMT_BGRA,
+		s_swsFlags, nullptr, nullptr, nullptr);
+	if (!context) {
+		return -1;
+	}
+	sws_scale(context, pic.data, pic.stride, 0, HEIGHT, dst, dstStride);
+	sws_freeContext(context);
+	convert(pic, ColorConverter::MATRIX_BT601, false, converted);
+	return maxDifference(reference, converted);
+}
+
+int main()
+{
+	static const char *matrixNames[] = { "bt601", "bt709" };
+	int failures = 0;
+	int error;
+
+	printf("kernels: %s\n", ColorConverter::implementation());
+	for (int matrix = 0; matrix < ColorConverter::MATRIX_NB; matrix++) {
+		for (int fullRange = 0; fullRange < 2; fullRange++) {
+			AVPixelFormat formats[] = { fullRange ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12, AV_PIX_FMT_NV21 };
+			for (AVPixelFormat format : formats) {
+				error = checkMatrix(format, static_cast<ColorConverter::Matrix>(matrix), fullRange != 0);
+				printf("%-9s %s %-7s max error %d\n", av_get_pix_fmt_name(format), matrixNames[matrix],
+					fullRange ? "full" : "limited", error);
+				failures += error < 0 || error > s_maxError;
+			}
+		}
+	}
+	AVPixelFormat layouts[] = { AV_PIX_FMT_NV12, AV_PIX_FMT_NV21 };
+	for (AVPixelFormat format : layouts) {
+		error = checkLayout(format);
+		printf("%-9s layout        max error %d\n", av_get_pix_fmt_name(format), error);
+		failures += error != 0;
+	}
+	error = checkPalette();
+	printf("%-9s               max error %d\n", av_get_pix_fmt_name(AV_PIX_FMT_PAL8), error);
+	failures += error != 0;
+
+	printf(failures ? "%d failed\n" : "ok\n", failures);
+	return failures ? 1 : 0;
+}
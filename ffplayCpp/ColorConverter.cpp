@@ -0,0 +1,351 @@
+#include "ColorConverter.h"
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/intreadwrite.h>
+}
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define HAVE_X86_KERNELS 0
+#endif
+
+// msvc takes any intrinsic, gcc and clang only in functions built for it
+#if defined(__GNUC__)
+#define TARGET(isa) __attribute__((target(isa)))
+#else
+#define TARGET(isa)
+#endif
+
+// 4:2:0 chroma layouts, c0 and c1 are the planes or the interleaved plane
+enum Layout {
+	LAYOUT_PLANAR,	// c0 is u, c1 is v
+	LAYOUT_NV12,	// c0 is uv
+	LAYOUT_NV21		// c0 is vu
+};
+
+// the fixed point of the x86 yuv2rgb of libswscale: samples shifted left by
+// SAMPLE_SHIFT times coefficients with 13 fractional bits, of which only the
+// high 16 bits are kept (pmulhw). that leaves 4 fractional bits, and every
+// sum fits 16 bits lanes. the c rows compute the same products, so that all
+// the kernels give the same bytes
+enum {
+	SAMPLE_SHIFT = 7,
+	PIXEL_SHIFT = 4
+};
+
+struct Coefficients
+{
+	int16_t yOffset;
+	int16_t y;
+	int16_t vr;
+	int16_t ug;
+	int16_t vg;
+	int16_t ub;
+};
+
+static constexpr int16_t q13(double v)
+{
+	return static_cast<int16_t>(v * (1 << 13) + 0.5);
+}
+
+static constexpr double chromaScale(bool fullRange)
+{
+	return fullRange ? 1.0 : 255.0 / 224;
+}
+
+static constexpr Coefficients coefficients(double kr, double kb, bool fullRange)
+{
+	return {
+		static_cast<int16_t>(fullRange ? 0 : 16),
+		q13(fullRange ? 1.0 : 255.0 / 219),
+		q13(2 * (1 - kr) * chromaScale(fullRange)),
+		q13(2 * (1 - kb) * kb / (1 - kr - kb) * chromaScale(fullRange)),
+		q13(2 * (1 - kr) * kr / (1 - kr - kb) * chromaScale(fullRange)),
+		q13(2 * (1 - kb) * chromaScale(fullRange))
+	};
+}
+
+// [matrix][full range]
+static constexpr Coefficients s_coefficients[ColorConverter::MATRIX_NB][2] = {
+	{ coefficients(0.299, 0.114, false), coefficients(0.299, 0.114, true) },
+	{ coefficients(0.2126, 0.0722, false), coefficients(0.2126, 0.0722, true) },
+};
+
+typedef void (*YuvRow)(const uint8_t *y, const uint8_t *c0, const uint8_t *c1, uint8_t *dst, int width, const Coefficients &c);
+typedef void (*PalRow)(const uint8_t *src, const uint32_t *pal, uint8_t *dst, int width);
+
+struct Kernels
+{
+	const char *name;
+	YuvRow yuvRows[3];	// by Layout
+	PalRow palRow;
+};
+
+// the high half of the 32 bits product, rounded down like pmulhw
+static inline int mulHigh(int sample, int coefficient)
+{
+	return (sample * coefficient) >> 16;
+}
+
+static inline uint8_t clipPixel(int v)
+{
+	return static_cast<uint8_t>(av_clip_uint8((v + (1 << (PIXEL_SHIFT - 1))) >> PIXEL_SHIFT));
+}
+
+// from pixel x on, x even. the simd rows finish their tails here
+template <int layout>
+static void yuvRowC(const uint8_t *y, const uint8_t *c0, const uint8_t *c1, uint8_t *dst, int width, const Coefficients &c, int x = 0)
+{
+	for (; x < width; x++) {
+		int u, v;
+		if (layout == LAYOUT_PLANAR) {
+			u = c0[x >> 1];
+			v = c1[x >> 1];
+		}
+		else {
+			u = c0[(x & ~1) + (layout == LAYOUT_NV21)];
+			v = c0[(x & ~1) + (layout == LAYOUT_NV12)];
+		}
+		int luma = mulHigh((y[x] - c.yOffset) * (1 << SAMPLE_SHIFT), c.y);
+		u = (u - 128) * (1 << SAMPLE_SHIFT);
+		v = (v - 128) * (1 << SAMPLE_SHIFT);
+		dst[4 * x + 0] = clipPixel(luma + mulHigh(u, c.ub));
+		dst[4 * x + 1] = clipPixel(luma - mulHigh(u, c.ug) - mulHigh(v, c.vg));
+		dst[4 * x + 2] = clipPixel(luma + mulHigh(v, c.vr));
+		dst[4 * x + 3] = 0xff;
+	}
+}
+
+template <int layout>
+static void yuvRowCEntry(const uint8_t *y, const uint8_t *c0, const uint8_t *c1, uint8_t *dst, int width, const Coefficients &c)
+{
+	yuvRowC<layout>(y, c0, c1, dst, width, c);
+}
+
+// the palette holds native endian argb, which is bgra in little endian bytes
+static void palRowC(const uint8_t *src, const uint32_t *pal, uint8_t *dst, int width)
+{
+	for (int x = 0; x < width; x++) {
+		AV_WL32(dst + 4 * x, pal[src[x]]);
+	}
+}
+
+#if HAVE_X86_KERNELS
+TARGET("sse2")
+static inline __m128i pixelSSE2(__m128i v)
+{
+	return _mm_srai_epi16(_mm_adds_epi16(v, _mm_set1_epi16(1 << (PIXEL_SHIFT - 1))), PIXEL_SHIFT);
+}
+
+// 8 pixels of 16 bits components to 32 bytes of bgra
+TARGET("sse2")
+static inline void storeBGRASSE2(uint8_t *dst, __m128i b, __m128i g, __m128i r)
+{
+	__m128i b8 = _mm_packus_epi16(pixelSSE2(b), _mm_setzero_si128());
+	__m128i g8 = _mm_packus_epi16(pixelSSE2(g), _mm_setzero_si128());
+	__m128i r8 = _mm_packus_epi16(pixelSSE2(r), _mm_setzero_si128());
+	__m128i bg = _mm_unpacklo_epi8(b8, g8);
+	__m128i ra = _mm_unpacklo_epi8(r8, _mm_set1_epi8(-1));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+template <int layout>
+TARGET("sse2")
+static void yuvRowSSE2(const uint8_t *y, const uint8_t *c0, const uint8_t *c1, uint8_t *dst, int width, const Coefficients &c)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i yOffset = _mm_set1_epi16(c.yOffset);
+	const __m128i chromaOffset = _mm_set1_epi16(128);
+	const __m128i cy = _mm_set1_epi16(c.y);
+	const __m128i cvr = _mm_set1_epi16(c.vr);
+	const __m128i cug = _mm_set1_epi16(c.ug);
+	const __m128i cvg = _mm_set1_epi16(c.vg);
+	const __m128i cub = _mm_set1_epi16(c.ub);
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(y + x)), zero);
+		__m128i u16, v16;
+		if (layout == LAYOUT_PLANAR) {
+			int32_t u4, v4;
+			memcpy(&u4, c0 + x / 2, 4);
+			memcpy(&v4, c1 + x / 2, 4);
+			u16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4), zero);
+			v16 = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v4), zero);
+			u16 = _mm_unpacklo_epi16(u16, u16);
+			v16 = _mm_unpacklo_epi16(v16, v16);
+		}
+		else {
+			// lanes c0 c1 c0 c1.., each pair duplicated for two pixels
+			__m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(c0 + x)), zero);
+			__m128i first = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+			__m128i second = _mm_shufflehi_epi16(_mm_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+			u16 = layout == LAYOUT_NV12 ? first : second;
+			v16 = layout == LAYOUT_NV12 ? second : first;
+		}
+
+		__m128i luma = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(y16, yOffset), SAMPLE_SHIFT), cy);
+		u16 = _mm_slli_epi16(_mm_sub_epi16(u16, chromaOffset), SAMPLE_SHIFT);
+		v16 = _mm_slli_epi16(_mm_sub_epi16(v16, chromaOffset), SAMPLE_SHIFT);
+		__m128i b = _mm_adds_epi16(luma, _mm_mulhi_epi16(u16, cub));
+		__m128i g = _mm_subs_epi16(_mm_subs_epi16(luma, _mm_mulhi_epi16(u16, cug)), _mm_mulhi_epi16(v16, cvg));
+		__m128i r = _mm_adds_epi16(luma, _mm_mulhi_epi16(v16, cvr));
+		storeBGRASSE2(dst + 4 * x, b, g, r);
+	}
+	yuvRowC<layout>(y, c0, c1, dst, width, c, x);
+}
+
+TARGET("avx2")
+static inline __m128i pixelsAVX2(__m256i v)
+{
+	v = _mm256_srai_epi16(_mm256_adds_epi16(v, _mm256_set1_epi16(1 << (PIXEL_SHIFT - 1))), PIXEL_SHIFT);
+	return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+template <int layout>
+TARGET("avx2")
+static void yuvRowAVX2(const uint8_t *y, const uint8_t *c0, const uint8_t *c1, uint8_t *dst, int width, const Coefficients &c)
+{
+	const __m128i dupFirst = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+	const __m128i dupSecond = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const __m256i yOffset = _mm256_set1_epi16(c.yOffset);
+	const __m256i chromaOffset = _mm256_set1_epi16(128);
+	const __m256i cy = _mm256_set1_epi16(c.y);
+	const __m256i cvr = _mm256_set1_epi16(c.vr);
+	const __m256i cug = _mm256_set1_epi16(c.ug);
+	const __m256i cvg = _mm256_set1_epi16(c.vg);
+	const __m256i cub = _mm256_set1_epi16(c.ub);
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16) {
+		__m256i y16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x)));
+		__m128i u8, v8;
+		if (layout == LAYOUT_PLANAR) {
+			__m128i u = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c0 + x / 2));
+			__m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(c1 + x / 2));
+			u8 = _mm_unpacklo_epi8(u, u);
+			v8 = _mm_unpacklo_epi8(v, v);
+		}
+		else {
+			__m128i uv = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c0 + x));
+			u8 = _mm_shuffle_epi8(uv, layout == LAYOUT_NV12 ? dupFirst : dupSecond);
+			v8 = _mm_shuffle_epi8(uv, layout == LAYOUT_NV12 ? dupSecond : dupFirst);
+		}
+
+		__m256i luma = _mm256_mulhi_epi16(_mm256_slli_epi16(_mm256_sub_epi16(y16, yOffset), SAMPLE_SHIFT), cy);
+		__m256i u16 = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(u8), chromaOffset), SAMPLE_SHIFT);
+		__m256i v16 = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_cvtepu8_epi16(v8), chromaOffset), SAMPLE_SHIFT);
+		__m128i b8 = pixelsAVX2(_mm256_adds_epi16(luma, _mm256_mulhi_epi16(u16, cub)));
+		__m128i g8 = pixelsAVX2(_mm256_subs_epi16(_mm256_subs_epi16(luma, _mm256_mulhi_epi16(u16, cug)), _mm256_mulhi_epi16(v16, cvg)));
+		__m128i r8 = pixelsAVX2(_mm256_adds_epi16(luma, _mm256_mulhi_epi16(v16, cvr)));
+
+		__m128i bgLo = _mm_unpacklo_epi8(b8, g8);
+		__m128i bgHi = _mm_unpackhi_epi8(b8, g8);
+		__m128i raLo = _mm_unpacklo_epi8(r8, alpha);
+		__m128i raHi = _mm_unpackhi_epi8(r8, alpha);
+		__m128i *out = reinterpret_cast<__m128i *>(dst + 4 * x);
+		_mm_storeu_si128(out, _mm_unpacklo_epi16(bgLo, raLo));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bgLo, raLo));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bgHi, raHi));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bgHi, raHi));
+	}
+	yuvRowC<layout>(y, c0, c1, dst, width, c, x);
+}
+
+TARGET("avx2")
+static void palRowAVX2(const uint8_t *src, const uint32_t *pal, uint8_t *dst, int width)
+{
+	int x;
+
+	for (x = 0; x + 8 <= width; x += 8) {
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + x)));
+		__m256i pixels = _mm256_i32gather_epi32(reinterpret_cast<const int *>(pal), index, 4);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 4 * x), pixels);
+	}
+	palRowC(src + x, pal, dst + 4 * x, width - x);
+}
+#endif
+
+static Kernels selectKernels()
+{
+#if HAVE_X86_KERNELS
+	int flags = av_get_cpu_flags();
+
+	if (flags & AV_CPU_FLAG_AVX2) {
+		return { "avx2", { yuvRowAVX2<LAYOUT_PLANAR>, yuvRowAVX2<LAYOUT_NV12>, yuvRowAVX2<LAYOUT_NV21> }, palRowAVX2 };
+	}
+	if (flags & AV_CPU_FLAG_SSE2) {
+		return { "sse2", { yuvRowSSE2<LAYOUT_PLANAR>, yuvRowSSE2<LAYOUT_NV12>, yuvRowSSE2<LAYOUT_NV21> }, palRowC };
+	}
+#endif
+	return { "c", { yuvRowCEntry<LAYOUT_PLANAR>, yuvRowCEntry<LAYOUT_NV12>, yuvRowCEntry<LAYOUT_NV21> }, palRowC };
+}
+
+static const Kernels s_kernels = selectKernels();
+
+bool ColorConverter::canConvert(AVPixelFormat srcFormat, AVPixelFormat dstFormat)
+{
+	if (dstFormat != AV_PIX_FMT_BGRA) {
+		return false;
+	}
+	switch (srcFormat) {
+	case AV_PIX_FMT_YUV420P:
+	case AV_PIX_FMT_YUVJ420P:
+	case AV_PIX_FMT_NV12:
+	case AV_PIX_FMT_NV21:
+	case AV_PIX_FMT_PAL8:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// unspecified is taken as bt.601, like libswscale does
+ColorConverter::Matrix ColorConverter::matrix(AVColorSpace colorspace)
+{
+	return colorspace == AVCOL_SPC_BT709 ? MATRIX_BT709 : MATRIX_BT601;
+}
+
+bool ColorConverter::isFullRange(AVPixelFormat format, AVColorRange range)
+{
+	return format == AV_PIX_FMT_YUVJ420P || range == AVCOL_RANGE_JPEG;
+}
+
+void ColorConverter::convert(AVPixelFormat srcFormat, const uint8_t * const * data, const int * stride, int width, int y, int height, uint8_t * dst, int dstStride, Matrix matrix, bool fullRange)
+{
+	const Coefficients &c = s_coefficients[matrix][fullRange];
+
+	for (int row = y; row < y + height; row++) {
+		const uint8_t *luma = data[0] + stride[0] * row;
+		uint8_t *out = dst + dstStride * row;
+
+		switch (srcFormat) {
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+			s_kernels.yuvRows[LAYOUT_PLANAR](luma, data[1] + stride[1] * (row >> 1), data[2] + stride[2] * (row >> 1), out, width, c);
+			break;
+		case AV_PIX_FMT_NV12:
+			s_kernels.yuvRows[LAYOUT_NV12](luma, data[1] + stride[1] * (row >> 1), nullptr, out, width, c);
+			break;
+		case AV_PIX_FMT_NV21:
+			s_kernels.yuvRows[LAYOUT_NV21](luma, data[1] + stride[1] * (row >> 1), nullptr, out, width, c);
+			break;
+		case AV_PIX_FMT_PAL8:
+			s_kernels.palRow(luma, reinterpret_cast<const uint32_t *>(data[1]), out, width);
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+const char * ColorConverter::implementation()
+{
+	return s_kernels.name;
+}
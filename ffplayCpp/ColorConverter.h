@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+extern "C" {
+#include <libavutil/pixfmt.h>
+}
+
+// hand-written conversions to BGRA of the formats the player converts most,
+// yuv420p, nv12, nv21 and pal8, without scaling. the kernels are picked for
+// the cpu once at startup: avx2 or sse2 on x86, plain c elsewhere.
+class ColorConverter
+{
+public:
+	enum Matrix {
+		MATRIX_BT601,
+		MATRIX_BT709,
+		MATRIX_NB
+	};
+
+public:
+	static bool canConvert(AVPixelFormat srcFormat, AVPixelFormat dstFormat);
+	static Matrix matrix(AVColorSpace colorspace);
+	static bool isFullRange(AVPixelFormat format, AVColorRange range);
+	// converts the rows [y, y + height) of a picture, y even for 4:2:0.
+	// data and dst point to the first row of the picture
+	static void convert(AVPixelFormat srcFormat, const uint8_t * const *data, const int *stride,
+		int width, int y, int height, uint8_t *dst, int dstStride, Matrix matrix, bool fullRange);
+	// the kernels picked, "avx2", "sse2" or "c"
+	static const char *implementation();
+};
@@ -1,5 +1,6 @@
 #include "Condition.h"
 #include "Mutex.h"
+#include "ThreadStats.h"
 
 
 Condition::Condition() :
@@ -19,10 +20,14 @@ int Condition::signal()
 
 int Condition::wait(Mutex & mutex)
 {
-	return SDL_CondWait(m_condition.get(), mutex.sdlMutex());
+	int ret = SDL_CondWait(m_condition.get(), mutex.sdlMutex());
+	ThreadStats::countWakeup();
+	return ret;
 }
 
 int Condition::waitTimeout(Mutex & mutex, Uint32 milisec)
 {
-	return SDL_CondWaitTimeout(m_condition.get(), mutex.sdlMutex(), milisec);
+	int ret = SDL_CondWaitTimeout(m_condition.get(), mutex.sdlMutex(), milisec);
+	ThreadStats::countWakeup();
+	return ret;
 }
@@ -1,33 +1,201 @@
 #include "Decoder.h"
 #include <SDL.h>
 #include "PacketQueue.h"
+#include "FrameQueue.h"
 #include "Thread.h"
-#include "Condition.h"
+#include "Notifier.h"
+#include "DecoderScheduler.h"
 
-Decoder::Decoder(AVCodecContext* avctx, PacketQueue &queue, Condition &emptyQueueCond) :
+Decoder::Decoder(const char *name, AVCodecContext* avctx, PacketQueue &queue, FrameQueue &frameQueue, Notifier &continueReadThread) :
+	Stage(name, STAGE_DECODER),
 	m_queue(queue),
+	m_frameQueue(frameQueue),
 	m_avctx(avctx),
-	m_emptyQueueCond(emptyQueueCond)
+	m_continueReadThread(continueReadThread)
 {
 	memset(&m_pkt, 0, sizeof(AVPacket));
+	setInput(m_queue);
 }
 
 
 Decoder::~Decoder()
 {
+	dropBatch();
+	DecoderScheduler::instance().remove(m_schedulerId);
+	av_dict_free(&m_codecOpts);
 }
 
-int Decoder::start(int (*func)(void*), void * arg)
+int Decoder::start(int (*func)(void*), void * arg, const char *name, const ThreadPolicy &policy)
 {
 	m_queue.start();
-	m_decoderThread = std::make_unique<Thread>(func, "decoder", arg);
+	m_decoderThread = std::make_unique<Thread>(func, name, arg, &m_threadStats, policy);
 	if (!m_decoderThread) {
 		av_log(nullptr, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
 		return AVERROR(ENOMEM);
 	}
+	m_started = true;
 	return 0;
 }
 
+int Decoder::startResumable(std::function<ResumableJob::Result()> step, Notifier & input, Notifier & output)
+{
+	m_queue.start();
+	m_job = std::make_unique<ResumableJob>(std::move(step));
+	m_jobInput = &input;
+	m_jobOutput = &output;
+	if (!input.addListener(m_job.get()) || !output.addListener(m_job.get())) {
+		av_log(nullptr, AV_LOG_ERROR, "%s: too many jobs on one notifier\n", name());
+	}
+	m_job->start();
+	return 0;
+}
+
+void Decoder::abort()
+{
+	m_queue.abort();
+	m_frameQueue.signal();
+	m_decoderThread.reset();
+	if (m_job) {
+		m_job->join();
+		m_jobInput->removeListener(m_job.get());
+		m_jobOutput->removeListener(m_job.get());
+	}
+	m_queue.flush();
+	dropBatch();
+	DecoderScheduler::instance().remove(m_schedulerId);
+	m_schedulerId = -1;
+}
+
+void Decoder::setScheduled(int schedulerId, AVDictionary * opts, const AVCodecParameters * par)
+{
+	AVDictionaryEntry *threads = av_dict_get(opts, "threads", nullptr, 0);
+	AVDictionaryEntry *lowres = av_dict_get(opts, "lowres", nullptr, 0);
+
+	m_schedulerId = schedulerId;
+	m_threads = threads ? atoi(threads->value) : 0;
+	m_lowres = lowres ? atoi(lowres->value) : 0;
+	m_wantedLowres = m_lowres;
+	av_dict_free(&m_codecOpts);
+	m_codecOpts = opts;
+	m_codecpar = par;
+}
+
+int Decoder::budget() const
+{
+	return m_schedulerId < 0 ? m_threads : DecoderScheduler::instance().threads(m_schedulerId);
+}
+
+// a budget the codec could not be opened with is not tried again
+bool Decoder::needsReopen() const
+{
+	int threads = budget();
+
+	return m_codecOpts && m_codecpar &&
+		((threads != m_threads && threads != m_refusedThreads) || m_wantedLowres != m_lowres);
+}
+
+// the codec forgets its state here anyway, so this is where a decoder whose
+// thread budget or lowres changed gets reopened with them
+void Decoder::flushCodec()
+{
+	m_draining = false;
+	if (!needsReopen() || reopenCodec(budget(), m_wantedLowres) < 0) {
+		avcodec_flush_buffers(m_avctx);
+	}
+}
+
+// opens a new context from the stream parameters and swaps it in, the codec
+// is never reopened in place. the old one stays when that fails. decoder
+// thread only, nobody else touches the context
+int Decoder::reopenCodec(int threads, int lowres)
+{
+	const AVCodec *codec = m_avctx->codec;
+	AVCodecContext *avctx = avcodec_alloc_context3(nullptr);
+	AVDictionary *opts = nullptr;
+	int ret;
+
+	if (!avctx) {
+		return AVERROR(ENOMEM);
+	}
+	if ((ret = avcodec_parameters_to_context(avctx, m_codecpar)) >= 0) {
+		avctx->codec_id = codec->id;
+		av_codec_set_pkt_timebase(avctx, av_codec_get_pkt_timebase(m_avctx));
+		avctx->flags = m_avctx->flags;
+		avctx->flags2 = m_avctx->flags2;
+		avctx->opaque = m_avctx->opaque;
+		avctx->get_buffer2 = m_avctx->get_buffer2;
+		avctx->thread_safe_callbacks = m_avctx->thread_safe_callbacks;
+
+		av_dict_copy(&opts, m_codecOpts, 0);
+		av_dict_set_int(&opts, "threads", threads, 0);
+		av_dict_set_int(&opts, "lowres", lowres, 0);
+		ret = avcodec_open2(avctx, codec, &opts);
+		av_dict_free(&opts);
+	}
+	if (ret < 0) {
+		av_log(m_avctx, AV_LOG_WARNING, "%s: could not reopen with %d threads, lowres %d\n", name(), threads, lowres);
+		avcodec_free_context(&avctx);
+		if (threads != m_threads) {
+			m_refusedThreads = threads;
+		}
+		// kept until another one is asked for
+		m_wantedLowres = m_lowres;
+		return ret;
+	}
+
+	av_log(avctx, AV_LOG_VERBOSE, "%s: %d -> %d threads, lowres %d -> %d\n", name(), m_threads, threads, m_lowres, lowres);
+	av_dict_set_int(&m_codecOpts, "threads", threads, 0);
+	av_dict_set_int(&m_codecOpts, "lowres", lowres, 0);
+	m_threads = threads;
+	m_lowres = lowres;
+	m_refusedThreads = 0;
+	m_faultyDtsBase = m_faultyDts;
+	m_faultyPtsBase = m_faultyPts;
+	avcodec_free_context(&m_avctx);
+	m_avctx = avctx;
+	return 0;
+}
+
+void Decoder::dropBatch()
+{
+	while (m_batchIndex < m_batchCount) {
+		av_packet_unref(&m_batch[m_batchIndex++]);
+	}
+}
+
+// gives up on the current GOP: drops the packets up to the next keyframe,
+// wherever it is queued, and the frames the codec still holds. returns the
+// number of packets dropped, 0 when no keyframe is queued yet
+int Decoder::skipToKeyframe()
+{
+	int keyIndex;
+	int dropped = 0;
+
+	for (keyIndex = m_batchIndex; keyIndex < m_batchCount; keyIndex++) {
+		if ((m_batch[keyIndex].flags & AV_PKT_FLAG_KEY) && m_queue.isSameSerial(m_batchSerials[keyIndex])) {
+			break;
+		}
+	}
+	if (keyIndex == m_batchCount && !m_queue.nbKeyframes()) {
+		return 0;
+	}
+
+	if (m_packetPending) {
+		av_packet_unref(&m_pkt);
+		m_packetPending = 0;
+		dropped++;
+	}
+	while (m_batchIndex < keyIndex) {
+		av_packet_unref(&m_batch[m_batchIndex++]);
+		dropped++;
+	}
+	if (keyIndex == m_batchCount) {
+		dropped += m_queue.dropToKeyframe();
+	}
+	flushCodec();
+	return dropped;
+}
+
 void Decoder::setStartPts(int64_t startPts)
 {
 	m_startPts = startPts;
@@ -40,10 +208,14 @@ void Decoder::setStartPtsTb(const AVRational & startPtsTb)
 
 static int s_decoderReorderPts = -1;
 
-int Decoder::decodeFrame(AVFrame * frame, AVSubtitle * sub)
+// returns AVERROR(EAGAIN) instead of waiting for a packet when !block
+int Decoder::decodeFrame(AVFrame * frame, AVSubtitle * sub, int block)
 {
 	int ret = AVERROR(EAGAIN);
 
+	if (m_started) {
+		m_threadStats.tick();
+	}
 	for (;;) {
 		AVPacket pkt;
 
@@ -58,6 +230,8 @@ int Decoder::decodeFrame(AVFrame * frame, AVSubtitle * sub)
 				case AVMEDIA_TYPE_VIDEO:
 					ret = avcodec_receive_frame(m_avctx, frame);
 					if (ret >= 0) {
+						m_faultyDts = m_faultyDtsBase + m_avctx->pts_correction_num_faulty_dts;
+						m_faultyPts = m_faultyPtsBase + m_avctx->pts_correction_num_faulty_pts;
 						if (s_decoderReorderPts == -1) {
 							frame->pts = frame->best_effort_timestamp;
 						}
@@ -85,35 +259,58 @@ int Decoder::decodeFrame(AVFrame * frame, AVSubtitle * sub)
 				default:
 					break;
 				}
+				if (ret == AVERROR_EOF && m_draining) {
+					// drained for a reopen, the keyframe pending goes to the new codec
+					m_draining = false;
+					if (reopenCodec(budget(), m_wantedLowres) < 0) {
+						avcodec_flush_buffers(m_avctx);
+					}
+					ret = AVERROR(EAGAIN);
+					break;
+				}
 				if (ret == AVERROR_EOF) {
 					m_finished = m_pktSerial;
-					avcodec_flush_buffers(m_avctx);
+					m_continueReadThread.notify();
+					flushCodec();
 					return 0;
 				}
 
 				if (ret >= 0) {
+					m_nbFrames.store(m_nbFrames.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
 					return 1;
 				}
 			} while (ret != AVERROR(EAGAIN));
 		}
 
-		do {
-			if (m_queue.nbPackets() == 0) {
-				m_emptyQueueCond.signal();
-			}
+		for (;;) {
 			if (m_packetPending) {
 				av_packet_move_ref(&pkt, &m_pkt);
 				m_packetPending = 0;
 			}
 			else {
-				if (m_queue.get(&pkt, 1, &m_pktSerial) < 0) {
-					return -1;
+				if (m_batchIndex == m_batchCount) {
+					int count = m_queue.getBatch(m_batch, m_batchSerials, PACKET_BATCH_SIZE, block);
+					if (count < 0) {
+						return -1;
+					}
+					if (count == 0) {
+						return AVERROR(EAGAIN);
+					}
+					m_batchIndex = 0;
+					m_batchCount = count;
 				}
+				av_packet_move_ref(&pkt, &m_batch[m_batchIndex]);
+				m_pktSerial = m_batchSerials[m_batchIndex++];
 			}
-		} while (!m_queue.isSameSerial(m_pktSerial));
+			if (m_queue.isSameSerial(m_pktSerial)) {
+				break;
+			}
+			// queued before the last flush
+			av_packet_unref(&pkt);
+		}
 
 		if (PacketQueue::isFlushData(pkt.data)) {
-			avcodec_flush_buffers(m_avctx);
+			flushCodec();
 			m_finished = 0;
 			m_nextPts = m_startPts;
 			m_nextPtsTb = m_startPtsTb;
@@ -133,6 +330,15 @@ int Decoder::decodeFrame(AVFrame * frame, AVSubtitle * sub)
 					ret = gotFrame ? 0 : (pkt.data ? AVERROR(EAGAIN) : AVERROR_EOF);
 				}
 			}
+			else if ((pkt.flags & AV_PKT_FLAG_KEY) && !m_draining && needsReopen() &&
+				avcodec_send_packet(m_avctx, nullptr) >= 0) {
+				// live streams may never flush, so a new budget or lowres is
+				// taken at a keyframe: the frames still in the codec come out
+				// first, then the new codec starts with this packet
+				m_packetPending = 1;
+				av_packet_move_ref(&m_pkt, &pkt);
+				m_draining = true;
+			}
 			else {
 				if (avcodec_send_packet(m_avctx, &pkt) == AVERROR(EAGAIN)) {
 					av_log(m_avctx, AV_LOG_ERROR, "Receive_frame and send_packet both returned EAGAIN, which is an API violation.\n");
@@ -6,38 +6,102 @@ extern "C" {
 
 #include <functional>
 #include <memory>
+#include "ThreadStats.h"
+#include "Stage.h"
+#include "ResumableJob.h"
 class PacketQueue;
+class FrameQueue;
 class Thread;
-class Condition;
+struct ThreadPolicy;
+class Notifier;
 
-class Decoder
+class Decoder : public Stage
 {
 public:
-	Decoder(AVCodecContext* avctx, PacketQueue &queue, Condition &emptyQueueCond);
+	enum {
+		PACKET_BATCH_SIZE = 8
+	};
+
+public:
+	Decoder(const char *name, AVCodecContext* avctx, PacketQueue &queue, FrameQueue &frameQueue, Notifier &continueReadThread);
 	~Decoder();
 
 public:
-	int start(int (*func)(void*), void *arg);
+	int start(int (*func)(void*), void *arg, const char *name, const ThreadPolicy &policy);
+	// runs step on the task pool instead of a thread, woken by the notifiers
+	// of the packet queue producer and the frame queue consumer
+	int startResumable(std::function<ResumableJob::Result()> step, Notifier &input, Notifier &output);
+	void abort();
+	// the codec was opened with the budget of schedulerId and opts, it is
+	// reopened from par with a new budget when it flushes or at the next
+	// keyframe. schedulerId is -1 when the threads were given. takes opts
+	void setScheduled(int schedulerId, AVDictionary *opts, const AVCodecParameters *par);
+	// the lowres the codec is reopened with at the next keyframe or flush,
+	// decoder thread only
+	void setLowres(int lowres) { m_wantedLowres = lowres; }
+	int lowres() const { return m_lowres; }
 	void setStartPts(int64_t startPts);
 	void setStartPtsTb(const AVRational &startPtsTb);
 	int pktSerial() { return m_pktSerial; }
-	int decodeFrame(AVFrame *frame, AVSubtitle *sub);
+	int decodeFrame(AVFrame *frame, AVSubtitle *sub, int block = 1);
+	int skipToKeyframe();
 	int finished() const { return m_finished; }
+	// replaced when the codec is reopened, decoder thread only
 	AVCodecContext *avctx() const { return m_avctx; }
+	int64_t nbFaultyDts() const { return m_faultyDts; }
+	int64_t nbFaultyPts() const { return m_faultyPts; }
+
+	const ThreadStats *threadStats() const override { return m_started ? &m_threadStats : nullptr; }
+	int64_t nbProcessed() const override { return m_nbFrames; }
+	void stop() override { abort(); }
+
+private:
+	void dropBatch();
+	int budget() const;
+	bool needsReopen() const;
+	void flushCodec();
+	int reopenCodec(int threads, int lowres);
 
 private:
 	AVPacket m_pkt;
 	AVPacket m_pktTemp;
 	PacketQueue &m_queue;
+	FrameQueue &m_frameQueue;
 	AVCodecContext* m_avctx;
 	int m_pktSerial = -1;
-	int m_finished = 0;
+	// read by the drained checks of the notifying threads
+	std::atomic<int> m_finished{ 0 };
 	int m_packetPending = 0;
-	Condition &m_emptyQueueCond;
+	// packets taken from the queue in one go, consumed one by one
+	AVPacket m_batch[PACKET_BATCH_SIZE];
+	int m_batchSerials[PACKET_BATCH_SIZE];
+	int m_batchIndex = 0;
+	int m_batchCount = 0;
+	Notifier &m_continueReadThread;
 	int64_t m_startPts = AV_NOPTS_VALUE;
 	AVRational m_startPtsTb = { 0, 0 };
 	int64_t m_nextPts = 0;
 	AVRational m_nextPtsTb = { 0, 0 };
+	ThreadStats m_threadStats;
+	std::atomic<int64_t> m_nbFrames{ 0 };
+	std::atomic<bool> m_started{ false };
 	std::unique_ptr<Thread> m_decoderThread;
+	std::unique_ptr<ResumableJob> m_job;
+	int m_schedulerId = -1;
+	int m_threads = 0;
+	int m_lowres = 0;
+	int m_wantedLowres = 0;
+	int m_refusedThreads = 0;
+	AVDictionary *m_codecOpts = nullptr;
+	const AVCodecParameters *m_codecpar = nullptr;
+	// sent the end of stream to empty the codec before it is reopened
+	bool m_draining = false;
+	// the counts of the contexts replaced are kept in the bases
+	std::atomic<int64_t> m_faultyDts{ 0 };
+	std::atomic<int64_t> m_faultyPts{ 0 };
+	int64_t m_faultyDtsBase = 0;
+	int64_t m_faultyPtsBase = 0;
+	Notifier *m_jobInput = nullptr;
+	Notifier *m_jobOutput = nullptr;
 };
 
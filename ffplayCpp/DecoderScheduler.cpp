@@ -0,0 +1,131 @@
+#include "DecoderScheduler.h"
+#include <SDL.h>
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/log.h>
+}
+#include "Mutex.h"
+
+// never destroyed, decoders may still leave when the process exits
+DecoderScheduler & DecoderScheduler::instance()
+{
+	static DecoderScheduler *scheduler = new DecoderScheduler(SDL_max(SDL_GetCPUCount(), 1));
+	return *scheduler;
+}
+
+DecoderScheduler::DecoderScheduler(int nbCores) :
+	m_nbCores(nbCores),
+	m_mutex(std::make_unique<Mutex>())
+{
+	for (auto &stream : m_streams) {
+		stream.name = nullptr;
+		stream.weight = 0;
+		stream.threads = 0;
+	}
+}
+
+
+DecoderScheduler::~DecoderScheduler()
+{
+}
+
+int DecoderScheduler::add(const char * name, int priority, int64_t pixelRate)
+{
+	int id = -1;
+
+	m_mutex->lock();
+	for (int i = 0; i < MAX_STREAMS; i++) {
+		if (!m_streams[i].weight) {
+			m_streams[i].name = name;
+			m_streams[i].weight = FFMAX(priority, 1) * FFMAX(pixelRate, 1);
+			id = i;
+			break;
+		}
+	}
+	if (id >= 0) {
+		rebalance();
+	}
+	m_mutex->unlock();
+
+	if (id < 0) {
+		av_log(nullptr, AV_LOG_WARNING, "decoder scheduler: no room for %s\n", name);
+	}
+	return id;
+}
+
+void DecoderScheduler::remove(int id)
+{
+	if (id < 0 || id >= MAX_STREAMS) {
+		return;
+	}
+
+	m_mutex->lock();
+	m_streams[id].weight = 0;
+	m_streams[id].threads = 0;
+	rebalance();
+	m_mutex->unlock();
+}
+
+// unknown streams decode single threaded
+int DecoderScheduler::threads(int id) const
+{
+	if (id < 0 || id >= MAX_STREAMS) {
+		return 1;
+	}
+	return FFMAX(m_streams[id].threads.load(), 1);
+}
+
+// called with the mutex held. the spare cores go by largest remainder, so
+// that the budgets always add up to the cores while there are fewer streams
+void DecoderScheduler::rebalance()
+{
+	int64_t remainders[MAX_STREAMS];
+	int64_t totalWeight = 0;
+	int nbStreams = 0;
+
+	for (auto &stream : m_streams) {
+		if (stream.weight) {
+			totalWeight += stream.weight;
+			nbStreams++;
+		}
+	}
+	if (!nbStreams) {
+		return;
+	}
+
+	int spare = FFMAX(m_nbCores - nbStreams, 0);
+	int given = 0;
+	for (int i = 0; i < MAX_STREAMS; i++) {
+		Stream &stream = m_streams[i];
+		remainders[i] = -1;
+		if (!stream.weight) {
+			continue;
+		}
+		double share = (double)spare * stream.weight / totalWeight;
+		int extra = static_cast<int>(share);
+		remainders[i] = static_cast<int64_t>((share - extra) * 1000000);
+		stream.threads = FFMIN(1 + extra, static_cast<int>(MAX_THREADS));
+		given += extra;
+	}
+	for (; given < spare; given++) {
+		int best = -1;
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			if (remainders[i] >= 0 && m_streams[i].threads < MAX_THREADS &&
+				(best < 0 || remainders[i] > remainders[best])) {
+				best = i;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		m_streams[best].threads++;
+		remainders[best] = -1;
+	}
+
+	for (auto &stream : m_streams) {
+		if (stream.weight) {
+			av_log(nullptr, AV_LOG_DEBUG, "decoder scheduler: %s gets %d of %d cores\n",
+				stream.name, stream.threads.load(), m_nbCores);
+		}
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class Mutex;
+
+// process wide share of the cores between the video decoders of every
+// VideoState. each stream gets one thread, the cores left are handed out
+// by weight (priority times pixel rate), and all budgets are worked out
+// again whenever a stream comes or goes. a decoder picks its new budget up
+// the next time it flushes its codec or reaches a keyframe.
+class DecoderScheduler
+{
+public:
+	static DecoderScheduler &instance();
+
+public:
+	enum {
+		MAX_STREAMS = 64,
+		MAX_THREADS = 16,	// what libavcodec allows for frame threads
+		PRIORITY_LOW = 1,
+		PRIORITY_NORMAL = 4,
+		PRIORITY_HIGH = 16
+	};
+
+public:
+	// returns the stream's id, -1 when there is no room for it
+	int add(const char *name, int priority, int64_t pixelRate);
+	void remove(int id);
+	int threads(int id) const;
+	int nbCores() const { return m_nbCores; }
+
+private:
+	struct Stream
+	{
+		const char *name;
+		int64_t weight;		// 0 when the slot is free
+		std::atomic<int> threads;
+	};
+
+private:
+	explicit DecoderScheduler(int nbCores);
+	~DecoderScheduler();
+
+	void rebalance();
+
+private:
+	int m_nbCores;
+	std::unique_ptr<Mutex> m_mutex;
+	Stream m_streams[MAX_STREAMS];
+};
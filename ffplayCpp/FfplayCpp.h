@@ -5,7 +5,7 @@ class VideoState;
 class FfPlayCpp
 {
 public:
-	FfPlayCpp();
+	explicit FfPlayCpp(bool nullSink = false);
 	~FfPlayCpp();
 
 public:
@@ -27,6 +27,7 @@ private:
 
 private:
 	VideoState *m_videoState = nullptr;
+	bool m_nullSink = false;
 };
 
 #endif
@@ -0,0 +1,112 @@
+#include "FrameConverter.h"
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/log.h>
+#include <libswscale/swscale.h>
+}
+#include "SwScaleContext.h"
+
+FrameConverter::FrameConverter(const char *name, int maxSlices, std::function<bool(AVPixelFormat)> accepts,
+	AVPixelFormat fallback, int flags) :
+	Stage(name, STAGE_CONVERTER),
+	m_accepts(std::move(accepts)),
+	m_fallback(fallback),
+	m_flags(flags),
+	m_context(std::make_unique<SwScaleContext>(maxSlices)),
+	m_converted(av_frame_alloc())
+{
+}
+
+
+// pictures still queued keep the pool alive until they are released
+FrameConverter::~FrameConverter()
+{
+	av_buffer_pool_uninit(&m_pool);
+}
+
+void FrameConverter::setTargetSize(int width, int height)
+{
+	m_targetWidth = width;
+	m_targetHeight = height;
+}
+
+int FrameConverter::process(AVFrame * frame)
+{
+	AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+	int targetWidth = m_targetWidth;
+	int targetHeight = m_targetHeight;
+	int width = frame->width;
+	int height = frame->height;
+	bool scale = false;
+	int ret;
+
+	// a picture barely larger than the target isn't worth it
+	if (targetWidth > 0 && targetHeight > 0 &&
+		targetWidth * 5 <= frame->width * 4 && targetHeight * 5 <= frame->height * 4) {
+		width = FFMAX(FFALIGN(targetWidth, 2), 2);
+		height = FFMAX(FFALIGN(targetHeight, 2), 2);
+		scale = true;
+	}
+	if (!m_accepts(format) || (scale && !sws_isSupportedOutput(format))) {
+		format = m_fallback;
+	}
+	if (!scale && format == frame->format) {
+		return 0;
+	}
+
+	AVRational sar = frame->sample_aspect_ratio.num ? frame->sample_aspect_ratio : av_make_q(1, 1);
+	// the scaled picture keeps the shape it is displayed with
+	sar = av_mul_q(sar, av_make_q(frame->width * height, frame->height * width));
+	if ((ret = convert(frame, width, height, format)) < 0) {
+		return ret;
+	}
+	frame->sample_aspect_ratio = sar;
+	return 0;
+}
+
+int FrameConverter::convert(AVFrame * frame, int width, int height, AVPixelFormat format)
+{
+	AVFrame *out = m_converted.get();
+	int size = av_image_get_buffer_size(format, width, height, LINESIZE_ALIGN);
+	int ret;
+
+	if (!out || size < 0) {
+		return !out ? AVERROR(ENOMEM) : size;
+	}
+	if (size != m_poolSize) {
+		av_buffer_pool_uninit(&m_pool);
+		m_pool = av_buffer_pool_init(size, nullptr);
+		m_poolSize = m_pool ? size : 0;
+	}
+	if (!m_pool || !(out->buf[0] = av_buffer_pool_get(m_pool))) {
+		return AVERROR(ENOMEM);
+	}
+	if ((ret = av_image_fill_arrays(out->data, out->linesize, out->buf[0]->data, format,
+		width, height, LINESIZE_ALIGN)) < 0) {
+		av_frame_unref(out);
+		return ret;
+	}
+	out->format = format;
+	out->width = width;
+	out->height = height;
+	av_frame_copy_props(out, frame);
+
+	m_context->setColorDetails(frame->colorspace, frame->color_range);
+	if (!m_context->applyCachedContext(frame->width, frame->height, static_cast<AVPixelFormat>(frame->format),
+		width, height, format, m_flags)) {
+		av_log(nullptr, AV_LOG_ERROR, "cannot initialize the conversion context\n");
+		av_frame_unref(out);
+		return AVERROR(EINVAL);
+	}
+	if (m_context->scale(frame->data, frame->linesize, 0, frame->height, out->data, out->linesize) <= 0) {
+		// the buffer holds nothing to show
+		av_frame_unref(out);
+		return AVERROR(EINVAL);
+	}
+
+	// the decoded picture goes back to its pool right away
+	av_frame_unref(frame);
+	av_frame_move_ref(frame, out);
+	m_nbConverted.store(m_nbConverted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/buffer.h>
+}
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "Stage.h"
+class SwScaleContext;
+
+// the converter stage between the video decoder and the display. it runs on
+// the thread that decodes the pictures, so that the render thread only
+// uploads: pictures in a format the sink doesn't take are converted, and
+// pictures shown much smaller than decoded are scaled down to the target
+// size. the converted pictures come from a buffer pool sized for the current
+// picture.
+class FrameConverter : public Stage
+{
+public:
+	// the sink takes the formats accepts() is true for, the others become
+	// fallback
+	FrameConverter(const char *name, int maxSlices, std::function<bool(AVPixelFormat)> accepts,
+		AVPixelFormat fallback, int flags);
+	~FrameConverter();
+
+public:
+	// the size the sink shows the pictures at, from any thread. 0 keeps the
+	// decoded size
+	void setTargetSize(int width, int height);
+	// converts frame in place when the sink needs it
+	int process(AVFrame *frame);
+	// replaces frame by its conversion to format, scaled to width x height
+	int convert(AVFrame *frame, int width, int height, AVPixelFormat format);
+	int64_t nbConverted() const { return m_nbConverted; }
+
+	// runs on the decoder thread, whose stats it is part of
+	const ThreadStats *threadStats() const override { return nullptr; }
+	int64_t nbProcessed() const override { return m_nbConverted; }
+
+private:
+	enum {
+		LINESIZE_ALIGN = 64
+	};
+
+private:
+	struct FrameDeleter
+	{
+		void operator()(AVFrame *frame) const
+		{
+			av_frame_free(&frame);
+		}
+	};
+
+private:
+	std::function<bool(AVPixelFormat)> m_accepts;
+	AVPixelFormat m_fallback;
+	int m_flags;
+	std::atomic<int> m_targetWidth{ 0 };
+	std::atomic<int> m_targetHeight{ 0 };
+	std::unique_ptr<SwScaleContext> m_context;
+	std::unique_ptr<AVFrame, FrameDeleter> m_converted;
+	AVBufferPool *m_pool = nullptr;
+	int m_poolSize = 0;
+	std::atomic<int64_t> m_nbConverted{ 0 };
+};
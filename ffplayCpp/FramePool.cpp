@@ -0,0 +1,218 @@
+#include "FramePool.h"
+#include "FrameQueue.h"
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+#include <cstdlib>
+#include <cstring>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+FramePool::FramePool(const FrameQueue &queue) :
+	m_queue(queue),
+	m_stats(std::make_shared<Stats>())
+{
+}
+
+
+FramePool::~FramePool()
+{
+	release();
+}
+
+void FramePool::attach(AVCodecContext * avctx)
+{
+	release();
+	avctx->opaque = this;
+	avctx->get_buffer2 = getBuffer2;
+	// libavcodec still calls it from one thread at a time
+	avctx->thread_safe_callbacks = 1;
+}
+
+int FramePool::getBuffer2(AVCodecContext * avctx, AVFrame * frame, int flags)
+{
+	FramePool *pool = static_cast<FramePool *>(avctx->opaque);
+
+	if (avctx->codec_type != AVMEDIA_TYPE_VIDEO || !(avctx->codec->capabilities & AV_CODEC_CAP_DR1) ||
+		frame->hw_frames_ctx || pool->getVideoBuffer(avctx, frame) < 0) {
+		return avcodec_default_get_buffer2(avctx, frame, flags);
+	}
+	return 0;
+}
+
+int FramePool::getVideoBuffer(AVCodecContext * avctx, AVFrame * frame)
+{
+	int i;
+
+	if ((frame->format != m_format || frame->width != m_width || frame->height != m_height) &&
+		!configure(avctx, frame)) {
+		return -1;
+	}
+
+	for (i = 0; i < 4 && m_pools[i]; i++) {
+		frame->buf[i] = av_buffer_pool_get(m_pools[i]);
+		if (!frame->buf[i]) {
+			for (int j = 0; j < i; j++) {
+				av_buffer_unref(&frame->buf[j]);
+			}
+			return -1;
+		}
+		frame->data[i] = frame->buf[i]->data;
+		frame->linesize[i] = m_linesize[i];
+	}
+	for (; i < AV_NUM_DATA_POINTERS; i++) {
+		frame->data[i] = nullptr;
+		frame->linesize[i] = 0;
+	}
+	frame->extended_data = frame->data;
+	return 0;
+}
+
+// same plane layout as avcodec_default_get_buffer2(), so that every decoder
+// gets the alignment and edges it expects
+bool FramePool::configure(AVCodecContext * avctx, AVFrame * frame)
+{
+	AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+	int strideAlign[AV_NUM_DATA_POINTERS];
+	int linesize[4];
+	uint8_t *data[4];
+	int sizes[4] = { 0, };
+	int w = frame->width;
+	int h = frame->height;
+	int unaligned;
+
+	release();
+
+	avcodec_align_dimensions2(avctx, &w, &h, strideAlign);
+	do {
+		if (av_image_fill_linesizes(linesize, format, w) < 0) {
+			return false;
+		}
+		// increase alignment of w for the next try (rhs gives the lowest bit set in w)
+		w += w & ~(w - 1);
+		unaligned = 0;
+		for (int i = 0; i < 4; i++) {
+			unaligned |= linesize[i] % strideAlign[i];
+		}
+	} while (unaligned);
+
+	int totalSize = av_image_fill_pointers(data, format, h, nullptr, linesize);
+	if (totalSize < 0) {
+		return false;
+	}
+	int i;
+	for (i = 0; i < 3 && data[i + 1]; i++) {
+		sizes[i] = static_cast<int>(data[i + 1] - data[i]);
+	}
+	sizes[i] = static_cast<int>(totalSize - (data[i] - data[0]));
+
+	for (i = 0; i < 4 && sizes[i]; i++) {
+		Plane *plane = new Plane{ m_stats, sizes[i] + 16 + BUFFER_ALIGN - 1, false };
+#ifdef __linux__
+		plane->hugePages = plane->size >= HUGE_PAGE_SIZE;
+#endif
+		m_pools[i] = av_buffer_pool_init2(plane->size, plane, allocBuffer, freePlane);
+		if (!m_pools[i]) {
+			delete plane;
+			release();
+			return false;
+		}
+		m_linesize[i] = linesize[i];
+	}
+	m_format = frame->format;
+	m_width = frame->width;
+	m_height = frame->height;
+
+	// fill the pools now rather than on the first frames
+	int count = nbPreallocated(avctx);
+	std::unique_ptr<AVBufferRef *[]> bufs(new AVBufferRef *[count * 4]());
+	for (int j = 0; j < count; j++) {
+		for (i = 0; i < 4 && m_pools[i]; i++) {
+			bufs[j * 4 + i] = av_buffer_pool_get(m_pools[i]);
+		}
+	}
+	for (int j = 0; j < count * 4; j++) {
+		av_buffer_unref(&bufs[j]);
+	}
+
+	av_log(avctx, AV_LOG_DEBUG, "frame pool: %d %s %dx%d pictures, %.1fMB\n",
+		count, av_get_pix_fmt_name(format), m_width, m_height, pinnedBytes() / (1024.0 * 1024.0));
+	return true;
+}
+
+// pictures alive at once: the queue at its current depth, the reference
+// frames, the reorder delay, one per frame thread and the one being decoded
+int FramePool::nbPreallocated(AVCodecContext * avctx) const
+{
+	return m_queue.depth() + FFMAX(avctx->refs, 1) + avctx->has_b_frames + FFMAX(avctx->thread_count, 1) + 1;
+}
+
+// buffers still in use keep their pool alive until they come back
+void FramePool::release()
+{
+	for (auto &pool : m_pools) {
+		av_buffer_pool_uninit(&pool);
+	}
+	m_format = -1;
+	m_width = 0;
+	m_height = 0;
+}
+
+AVBufferRef * FramePool::allocBuffer(void * opaque, int size)
+{
+	Plane *plane = static_cast<Plane *>(opaque);
+	uint8_t *data = nullptr;
+
+#ifdef __linux__
+	if (plane->hugePages) {
+		void *mem = nullptr;
+		if (!posix_memalign(&mem, HUGE_PAGE_SIZE, size)) {
+			data = static_cast<uint8_t *>(mem);
+			madvise(data, size, MADV_HUGEPAGE);
+		}
+	}
+	else
+#endif
+	{
+		data = static_cast<uint8_t *>(av_malloc(size));
+	}
+	if (!data) {
+		return nullptr;
+	}
+	// touches every page here instead of in the decoder
+	memset(data, 0, size);
+
+	plane->stats->pinnedBytes += size;
+	plane->stats->buffers++;
+	AVBufferRef *buf = av_buffer_create(data, size, freeBuffer, plane, 0);
+	if (!buf) {
+		freeBuffer(plane, data);
+		return nullptr;
+	}
+	return buf;
+}
+
+
+void FramePool::freeBuffer(void * opaque, uint8_t * data)
+{
+	Plane *plane = static_cast<Plane *>(opaque);
+
+#ifdef __linux__
+	if (plane->hugePages) {
+		free(data);
+	}
+	else
+#endif
+	{
+		av_free(data);
+	}
+	plane->stats->pinnedBytes -= plane->size;
+	plane->stats->buffers--;
+}
+
+void FramePool::freePlane(void * opaque)
+{
+	delete static_cast<Plane *>(opaque);
+}
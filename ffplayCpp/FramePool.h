@@ -0,0 +1,68 @@
+#pragma once
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+#include <atomic>
+#include <memory>
+class FrameQueue;
+
+// get_buffer2 for a video decoder. picture planes come from one buffer pool
+// per plane, filled up front for the frames a stream holds at once (the
+// current depth of its FrameQueue, the codec references and the frame
+// threads) and pre-faulted, so steady decoding allocates nothing. a deeper
+// queue takes more buffers from the pools as it needs them. large planes ask
+// for huge pages where the system has them.
+class FramePool
+{
+public:
+	explicit FramePool(const FrameQueue &queue);
+	~FramePool();
+
+public:
+	// must be called before avcodec_open2(). the pools are made again for
+	// the new codec
+	void attach(AVCodecContext *avctx);
+
+	int64_t pinnedBytes() const { return m_stats->pinnedBytes; }
+	int nbBuffers() const { return m_stats->buffers; }
+
+private:
+	enum {
+		BUFFER_ALIGN = 64,
+		HUGE_PAGE_SIZE = 2 * 1024 * 1024
+	};
+
+	// shared with the planes, which can outlive the pool
+	struct Stats
+	{
+		std::atomic<int64_t> pinnedBytes{ 0 };
+		std::atomic<int> buffers{ 0 };
+	};
+
+	struct Plane
+	{
+		std::shared_ptr<Stats> stats;
+		int size;
+		bool hugePages;
+	};
+
+private:
+	static int getBuffer2(AVCodecContext *avctx, AVFrame *frame, int flags);
+	static AVBufferRef *allocBuffer(void *opaque, int size);
+	static void freeBuffer(void *opaque, uint8_t *data);
+	static void freePlane(void *opaque);
+	int getVideoBuffer(AVCodecContext *avctx, AVFrame *frame);
+	bool configure(AVCodecContext *avctx, AVFrame *frame);
+	void release();
+	int nbPreallocated(AVCodecContext *avctx) const;
+
+private:
+	const FrameQueue &m_queue;
+	std::shared_ptr<Stats> m_stats;
+	AVBufferPool *m_pools[4] = { nullptr, };
+	int m_linesize[4] = { 0, };
+	int m_width = 0;
+	int m_height = 0;
+	int m_format = -1;
+};
@@ -1,7 +1,12 @@
 #include "FrameQueue.h"
 #include <SDL.h>
+#include <cmath>
+extern "C" {
+#include <libavutil/time.h>
+}
 #include "PacketQueue.h"
 #include "Condition.h"
+#include "Notifier.h"
 #include "Mutex.h"
 
 void Frame::unref()
@@ -15,7 +20,34 @@ void Frame::moveRef(AVFrame * frame)
 	av_frame_move_ref(m_frame, frame);
 }
 
-FrameQueue::FrameQueue(PacketQueue & pktQ, int maxSize, int keepLast) :
+int64_t Frame::updateFootprint()
+{
+	int64_t bytes = 0;
+
+	for (int i = 0; i < AV_NUM_DATA_POINTERS && m_frame->buf[i]; i++) {
+		bytes += m_frame->buf[i]->size;
+	}
+	for (int i = 0; i < m_frame->nb_extended_buf; i++) {
+		bytes += m_frame->extended_buf[i]->size;
+	}
+	for (unsigned int i = 0; i < m_sub.num_rects; i++) {
+		const AVSubtitleRect *rect = m_sub.rects[i];
+		bytes += sizeof(*rect) + rect->linesize[0] * rect->h;
+		if (rect->data[1]) {
+			bytes += AVPALETTE_SIZE;
+		}
+	}
+	m_footprint = bytes;
+	return bytes;
+}
+
+FrameQueue::FrameQueue(PacketQueue & pktQ, int minSize, int size, int maxSize, int keepLast) :
+	m_queue(new Frame[maxSize]),
+	m_capacity(maxSize),
+	m_minDepth(minSize),
+	m_maxDepth(maxSize),
+	m_depth(av_clip(size, minSize, maxSize)),
+	m_peakDepth(m_depth.load()),
 	m_mutex(std::make_unique<Mutex>()),
 	m_pktQ(pktQ)
 {
@@ -29,7 +61,6 @@ FrameQueue::FrameQueue(PacketQueue & pktQ, int maxSize, int keepLast) :
 		// TODO : throw exception
 	}
 
-	m_maxSize = FFMIN(maxSize, FRAME_QUEUE_SIZE);
 	m_keepLast = !!keepLast;
 }
 
@@ -46,12 +77,12 @@ void FrameQueue::signal()
 
 Frame * FrameQueue::peek()
 {	
-	return &m_queue[(m_rIndex + m_rIndexShown) % m_maxSize];
+	return &m_queue[(m_rIndex + m_rIndexShown) % m_capacity];
 }
 
 Frame * FrameQueue::peekNext()
 {
-	return &m_queue[(m_rIndex + m_rIndexShown + 1) % m_maxSize];
+	return &m_queue[(m_rIndex + m_rIndexShown + 1) % m_capacity];
 }
 
 Frame * FrameQueue::peekLast()
@@ -61,14 +92,7 @@ Frame * FrameQueue::peekLast()
 
 Frame * FrameQueue::peekWritable()
 {
-	m_mutex->lock();
-	while (m_size >= m_maxSize && !m_pktQ.isAbortRequested()) {
-		m_cond->wait(*m_mutex);		
-	}
-
-	m_mutex->unlock();
-
-	if (m_pktQ.isAbortRequested()) {
+	if (!waitWritable(1)) {
 		return nullptr;
 	}
 
@@ -77,43 +101,159 @@ Frame * FrameQueue::peekWritable()
 
 Frame * FrameQueue::peekReadable()
 {
-	m_mutex->lock();
-	while (m_size - m_rIndexShown <= 0 && !m_pktQ.isAbortRequested()) {
-		m_cond->wait(*m_mutex);
+	if (remaining() <= 0) {
+		m_mutex->lock();
+		m_consumerWaiting = true;
+		while (remaining() <= 0 && !m_pktQ.isAbortRequested()) {
+			m_cond->wait(*m_mutex);
+		}
+		m_consumerWaiting = false;
+		m_mutex->unlock();
 	}
-	m_mutex->unlock();
 
 	if (m_pktQ.isAbortRequested()) {
 		return nullptr;
 	}
 
-	return &m_queue[(m_rIndex + m_rIndexShown) % m_maxSize];
+	return &m_queue[(m_rIndex + m_rIndexShown) % m_capacity];
 }
 
-void FrameQueue::push()
+bool FrameQueue::isWritable(int count) const
 {
-	if (++m_wIndex == m_maxSize) {
-		m_wIndex = 0;
+	int depth = m_depth;
+	count = FFMAX(FFMIN(count, depth - m_keepLast), 1);
+	return size() + count <= depth;
+}
+
+// blocks until count frames can be written without waiting. the frame kept
+// for display doesn't count against a batch, so a batch always fits
+int FrameQueue::waitWritable(int count)
+{
+	int depth = m_depth;
+	count = FFMAX(FFMIN(count, depth - m_keepLast), 1);
+
+	if (size() + count > depth) {
+		int64_t waitStart = av_gettime_relative();
+
+		m_mutex->lock();
+		m_producerWaiting = true;
+		while (size() + count > depth && !m_pktQ.isAbortRequested()) {
+			m_cond->wait(*m_mutex);
+		}
+		m_producerWaiting = false;
+		m_mutex->unlock();
+
+		m_blockedTime += av_gettime_relative() - waitStart;
+	}
+
+	return !m_pktQ.isAbortRequested();
+}
+
+// offset counts the frames written but not pushed yet
+Frame * FrameQueue::writable(int offset)
+{
+	return &m_queue[(m_wIndex + offset) % m_capacity];
+}
+
+void FrameQueue::push(int count)
+{
+	int64_t bytes = 0;
+	for (int i = 0; i < count; i++) {
+		bytes += writable(i)->updateFootprint();
+	}
+	m_bytes += bytes;
+	if (m_minDepth < m_maxDepth) {
+		updateDepth(av_gettime_relative(), count);
+	}
+
+	m_wIndex = (m_wIndex + count) % m_capacity;
+	m_pushCalls++;
+	m_pushedFrames += count;
+
+	// publishes the frames, seq_cst so that a sleeping consumer can't be missed
+	m_pushed.store(m_pushed.load(std::memory_order_relaxed) + count);
+	if (m_consumerWaiting) {
+		wakeUp();
+	}
+	if (m_producerNotifier) {
+		m_producerNotifier->notify();
 	}
-	m_mutex->lock();
-	m_size++;
-	m_cond->signal();
-	m_mutex->unlock();
 }
 
 void FrameQueue::next()
 {
 	if (m_keepLast && !m_rIndexShown) {
 		m_rIndexShown = 1;
+		if (m_consumerNotifier) {
+			m_consumerNotifier->notify();
+		}
 		return;
 	}
+	m_bytes -= m_queue[m_rIndex].footprint();
 	m_queue[m_rIndex].unref();
-	if (++m_rIndex == m_maxSize) {
+	if (++m_rIndex == m_capacity) {
 		m_rIndex = 0;
 	}
-	m_mutex->lock();
 
-	m_size--;
+	// hands the slot back to the producer
+	m_released.store(m_released.load(std::memory_order_relaxed) + 1);
+	if (m_producerWaiting) {
+		wakeUp();
+	}
+	if (m_consumerNotifier) {
+		m_consumerNotifier->notify();
+	}
+}
+
+// called from the producer on each push. the depth follows the spread of the
+// time it takes to produce a frame: a steady decoder needs the minimum, a
+// bursty one (frame threads, B-frame reordering) a queue deep enough to
+// cover a couple of standard deviations of its production time.
+void FrameQueue::updateDepth(int64_t now, int count)
+{
+	int64_t busy = m_lastPushTime ? now - m_lastPushTime - m_blockedTime : 0;
+	m_lastPushTime = now;
+	m_blockedTime = 0;
+	if (busy <= 0 || busy > MAX_BUSY_SAMPLE) {
+		return;
+	}
+
+	double sample = (double)busy / count;
+	for (int i = 0; i < count; i++) {
+		double diff = sample - m_busyMean;
+		m_busyMean += diff / JITTER_AVERAGING;
+		m_busyVariance = (m_busyVariance + diff * diff / JITTER_AVERAGING) * (JITTER_AVERAGING - 1) / JITTER_AVERAGING;
+	}
+
+	m_samples += count;
+	if (m_samples < DEPTH_UPDATE_INTERVAL || m_busyMean <= 0.0) {
+		return;
+	}
+	m_samples = 0;
+
+	int depth = m_minDepth + static_cast<int>(ceil(2.0 * sqrt(m_busyVariance) / m_busyMean));
+	depth = av_clip(depth, m_minDepth, m_maxDepth);
+	if (depth != m_depth) {
+		av_log(nullptr, AV_LOG_DEBUG, "frame queue depth %d -> %d (busy %.0f +- %.0f us)\n",
+			m_depth.load(), depth, m_busyMean, sqrt(m_busyVariance));
+		m_depth = depth;
+		if (depth > m_peakDepth) {
+			m_peakDepth = depth;
+		}
+	}
+}
+
+// called before the producer starts
+void FrameQueue::setDepthRange(int minSize, int maxSize)
+{
+	m_maxDepth = av_clip(maxSize, 1, m_capacity);
+	m_minDepth = av_clip(minSize, 1, m_maxDepth);
+	m_depth = av_clip(m_depth, m_minDepth, m_maxDepth);
+}
+
+void FrameQueue::wakeUp()
+{
+	m_mutex->lock();
 	m_cond->signal();
 	m_mutex->unlock();
 }
@@ -135,7 +275,14 @@ void FrameQueue::unlock()
 
 int FrameQueue::remaining() const
 {
-	return m_size - m_rIndexShown;
+	return size() - m_rIndexShown;
+}
+
+// consumer side first, so that the difference never goes negative
+int FrameQueue::size() const
+{
+	unsigned int released = m_released.load();
+	return static_cast<int>(m_pushed.load() - released);
 }
 
 int64_t FrameQueue::lastPos() const
@@ -3,10 +3,12 @@
 extern "C" {
 #include <libavformat/avformat.h>
 }
+#include <atomic>
 #include <memory>
 class Mutex;
 class PacketQueue;
 class Condition;
+class Notifier;
 
 class Frame
 {
@@ -62,6 +64,9 @@ public:
 	}
 
 	void moveRef(AVFrame *frame);
+	// bytes held by the picture, samples or subtitle, counted once it is pushed
+	int64_t updateFootprint();
+	int64_t footprint() const { return m_footprint; }
 	double pts() const { return m_pts; }
 	double duration() const { return m_duration; }
 	AVFrame *frame() const { return m_frame; }
@@ -97,12 +102,16 @@ private:
 	AVRational m_sar = { 0, 0 };
 	int m_uploaded = 0;
 	int m_flipV = 0;
+	int64_t m_footprint = 0;
 };
 
+// single-producer(decoder)/single-consumer(renderer or audio callback) ring.
+// the mutex is only taken when one side has to sleep on an empty or full
+// queue, and by lock()/unlock() callers
 class FrameQueue
 {
 public:
-	FrameQueue(PacketQueue &pktQ, int maxSize, int keepLast);
+	FrameQueue(PacketQueue &pktQ, int minSize, int size, int maxSize, int keepLast);
 	~FrameQueue();
 
 public:
@@ -111,34 +120,92 @@ public:
 	Frame *peekNext();
 	Frame *peekLast();
 	Frame *peekWritable();
+	// whether waitWritable(count) would return at once
+	bool isWritable(int count) const;
 	Frame *peekReadable();
-	void push();
+	int waitWritable(int count);
+	Frame *writable(int offset);
+	void push(int count = 1);
 	void next();
 	int remaining() const;
 	int64_t lastPos() const;
 	int rIndexShown() const;
+	int64_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+	int depth() const { return m_depth; }
+	int peakDepth() const { return m_peakDepth; }
+	// narrows the range the depth adapts in, maxSize can't exceed the storage
+	void setDepthRange(int minSize, int maxSize);
+	double averagePushBatch() const {
+		return m_pushCalls ? (double)m_pushedFrames / m_pushCalls : 0.0;
+	}
 	
 	void lock();
 	void unlock();
 
+	// notified each time the consumer releases a frame
+	void setConsumerNotifier(Notifier *notifier) { m_consumerNotifier = notifier; }
+	// notified each time the producer pushes frames
+	void setProducerNotifier(Notifier *notifier) { m_producerNotifier = notifier; }
+
 public:
+	// the depth starts at *_SIZE and adapts between *_MIN and *_MAX
 	enum {
+		VIDEO_PICTURE_QUEUE_MIN = 2,
 		VIDEO_PICTURE_QUEUE_SIZE = 3,
+		VIDEO_PICTURE_QUEUE_MAX = 8,
 		SUBPICTURE_QUEUE_SIZE = 16,
+		SAMPLE_QUEUE_MIN = 4,
 		SAMPLE_QUEUE_SIZE = 9,
-		FRAME_QUEUE_SIZE = FFMAX(SAMPLE_QUEUE_SIZE, FFMAX(VIDEO_PICTURE_QUEUE_SIZE, SUBPICTURE_QUEUE_SIZE))
+		SAMPLE_QUEUE_MAX = 16
+	};
+
+	enum {
+		DEPTH_UPDATE_INTERVAL = 32,	// frames between two depth decisions
+		JITTER_AVERAGING = 16,		// weight of one sample is 1/JITTER_AVERAGING
+		MAX_BUSY_SAMPLE = 1000000	// us, longer gaps are stalls, not jitter
 	};
 
 private:
-	Frame m_queue[FRAME_QUEUE_SIZE];
-	int m_rIndex = 0;
-	int m_wIndex = 0;
-	int m_size = 0;
-	int m_maxSize = 0;
+	void updateDepth(int64_t now, int count);
+	int size() const;
+	void wakeUp();
+
+private:
+	// the ring spans the storage, the depth only limits how many frames it holds.
+	// the storage is made for the maximum depth up front, so that both sides
+	// index it without a lock when the depth changes. an unused slot is an
+	// empty AVFrame, only queued frames hold picture or sample buffers
+	std::unique_ptr<Frame[]> m_queue;
+	int m_capacity = 0;
+	int m_minDepth = 0;
+	int m_maxDepth = 0;
+	std::atomic<int> m_depth{ 0 };
+	std::atomic<int> m_peakDepth{ 0 };
 	int m_keepLast = 0;
-	int m_rIndexShown = 0;
+	std::atomic<int64_t> m_bytes{ 0 };
 	std::unique_ptr<Mutex> m_mutex;
 	std::unique_ptr<Condition> m_cond;
+	Notifier *m_consumerNotifier = nullptr;
+	Notifier *m_producerNotifier = nullptr;
 	PacketQueue &m_pktQ;
+
+	// written by the producer only
+	int m_wIndex = 0;
+	std::atomic<unsigned int> m_pushed{ 0 };
+	std::atomic<bool> m_producerWaiting{ false };
+	int64_t m_pushCalls = 0;
+	int64_t m_pushedFrames = 0;
+	// per frame time the producer spends producing, waits for room excluded
+	int64_t m_lastPushTime = 0;
+	int64_t m_blockedTime = 0;
+	double m_busyMean = 0.0;
+	double m_busyVariance = 0.0;
+	int m_samples = 0;
+
+	// written by the consumer only
+	int m_rIndex = 0;
+	std::atomic<int> m_rIndexShown{ 0 };
+	std::atomic<unsigned int> m_released{ 0 };
+	std::atomic<bool> m_consumerWaiting{ false };
 };
 
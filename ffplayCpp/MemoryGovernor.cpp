@@ -0,0 +1,90 @@
+#include "MemoryGovernor.h"
+#include "PacketQueue.h"
+#include "FrameQueue.h"
+
+MemoryGovernor::MemoryGovernor(int64_t maxPacketBytes, int64_t maxTotalBytes) :
+	m_maxPacketBytes(maxPacketBytes),
+	m_maxTotalBytes(maxTotalBytes)
+{
+	for (auto &scratch : m_scratch) {
+		scratch = 0;
+	}
+}
+
+
+MemoryGovernor::~MemoryGovernor()
+{
+}
+
+void MemoryGovernor::addStream(const PacketQueue & pktQ, const FrameQueue & frameQ, bool shared)
+{
+	if (m_nbStreams < MAX_STREAMS) {
+		m_streams[m_nbStreams++] = { &pktQ, &frameQ, shared };
+	}
+}
+
+int64_t MemoryGovernor::packetBytes() const
+{
+	int64_t bytes = 0;
+	for (int i = 0; i < m_nbStreams; i++) {
+		bytes += m_streams[i].pktQ->size64();
+	}
+	return bytes;
+}
+
+int64_t MemoryGovernor::frameBytes() const
+{
+	int64_t bytes = 0;
+	for (int i = 0; i < m_nbStreams; i++) {
+		bytes += m_streams[i].frameQ->bytes();
+	}
+	return bytes;
+}
+
+int64_t MemoryGovernor::scratchBytes() const
+{
+	int64_t bytes = 0;
+	for (auto &scratch : m_scratch) {
+		bytes += scratch.load(std::memory_order_relaxed);
+	}
+	return bytes;
+}
+
+// over the packet budget, a stream that is below its share and hasn't got
+// enough packets yet keeps the read thread going, so that one stream with
+// huge packets can't starve the others. the total cap always holds.
+bool MemoryGovernor::isFull(const bool *hasEnough)
+{
+	int64_t packets = packetBytes();
+	int64_t total = packets + frameBytes() + scratchBytes();
+	int64_t peak = m_peakTotal.load(std::memory_order_relaxed);
+	int nbShared = 0;
+
+	while (total > peak && !m_peakTotal.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {
+	}
+
+	if (m_maxTotalBytes && total > m_maxTotalBytes) {
+		return true;
+	}
+	if (packets <= m_maxPacketBytes) {
+		return false;
+	}
+
+	for (int i = 0; i < m_nbStreams; i++) {
+		if (m_streams[i].shared && !m_streams[i].pktQ->isAbortRequested()) {
+			nbShared++;
+		}
+	}
+	if (!nbShared) {
+		return true;
+	}
+
+	int64_t share = m_maxPacketBytes / nbShared;
+	for (int i = 0; i < m_nbStreams; i++) {
+		const PacketQueue &pktQ = *m_streams[i].pktQ;
+		if (m_streams[i].shared && !pktQ.isAbortRequested() && !hasEnough[i] && pktQ.size64() < share) {
+			return false;
+		}
+	}
+	return true;
+}
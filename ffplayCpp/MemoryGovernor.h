@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+class PacketQueue;
+class FrameQueue;
+
+// adds up what one VideoState really holds, packet buffers and decoded frames
+// of every stream plus conversion scratch, and tells the read thread when to
+// stop. all counters are 64 bit, each queue keeps its own exact footprint.
+class MemoryGovernor
+{
+public:
+	MemoryGovernor(int64_t maxPacketBytes, int64_t maxTotalBytes);
+	~MemoryGovernor();
+
+public:
+	enum {
+		MAX_STREAMS = 3
+	};
+
+	enum Scratch {
+		SCRATCH_AUDIO_BUFFER,
+		SCRATCH_VIDEO_TEXTURE,
+		SCRATCH_SUBTITLE_TEXTURE,
+		SCRATCH_VIS_TEXTURE,
+		SCRATCH_FRAME_POOL,
+		SCRATCH_NB
+	};
+
+public:
+	// a stream that doesn't share the packet budget (subtitles) only counts
+	// towards the totals
+	void addStream(const PacketQueue &pktQ, const FrameQueue &frameQ, bool shared = true);
+	void setScratch(Scratch scratch, int64_t bytes) { m_scratch[scratch] = bytes; }
+
+	int64_t packetBytes() const;
+	int64_t frameBytes() const;
+	int64_t scratchBytes() const;
+	int64_t totalBytes() const { return packetBytes() + frameBytes() + scratchBytes(); }
+	int64_t peakTotalBytes() const { return m_peakTotal; }
+
+	// called from the read thread. hasEnough tells for each stream, in the
+	// order they were added, whether its queue holds enough packets
+	bool isFull(const bool *hasEnough);
+
+private:
+	struct Stream
+	{
+		const PacketQueue *pktQ;
+		const FrameQueue *frameQ;
+		bool shared;
+	};
+
+private:
+	int64_t m_maxPacketBytes;
+	int64_t m_maxTotalBytes;
+	Stream m_streams[MAX_STREAMS];
+	int m_nbStreams = 0;
+	std::atomic<int64_t> m_scratch[SCRATCH_NB];
+	std::atomic<int64_t> m_peakTotal{ 0 };
+};
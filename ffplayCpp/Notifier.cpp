@@ -0,0 +1,92 @@
+#include "Notifier.h"
+#include "Mutex.h"
+#include "Condition.h"
+#include "ResumableJob.h"
+
+Notifier::Notifier() :
+	m_mutex(std::make_unique<Mutex>()),
+	m_cond(std::make_unique<Condition>())
+{
+}
+
+
+Notifier::~Notifier()
+{
+}
+
+void Notifier::wait(const std::function<bool()> &condition)
+{
+	m_mutex->lock();
+	m_condition = &condition;
+	// announced before the condition is checked, pairs with the fence in notify()
+	m_waiters++;
+	while (!condition()) {
+		m_cond->wait(*m_mutex);
+	}
+	m_waiters--;
+	m_condition = nullptr;
+	m_mutex->unlock();
+}
+
+bool Notifier::waitTimeout(const std::function<bool()> &condition, Uint32 milisec)
+{
+	bool ret;
+
+	m_mutex->lock();
+	m_condition = &condition;
+	m_waiters++;
+	ret = condition();
+	if (!ret) {
+		m_cond->waitTimeout(*m_mutex, milisec);
+		ret = condition();
+	}
+	m_waiters--;
+	m_condition = nullptr;
+	m_mutex->unlock();
+
+	return ret;
+}
+
+void Notifier::notify()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!m_waiters.load() && !m_nbListeners.load()) {
+		return;
+	}
+
+	m_mutex->lock();
+	if (m_condition && (*m_condition)()) {
+		m_cond->signal();
+	}
+	for (int i = 0; i < m_nbListeners; i++) {
+		m_listeners[i]->wake();
+	}
+	m_mutex->unlock();
+}
+
+bool Notifier::addListener(ResumableJob * job)
+{
+	bool added = false;
+
+	m_mutex->lock();
+	if (m_nbListeners < MAX_LISTENERS) {
+		m_listeners[m_nbListeners] = job;
+		m_nbListeners++;
+		added = true;
+	}
+	m_mutex->unlock();
+	return added;
+}
+
+void Notifier::removeListener(ResumableJob * job)
+{
+	m_mutex->lock();
+	for (int i = 0; i < m_nbListeners; i++) {
+		if (m_listeners[i] == job) {
+			m_listeners[i] = m_listeners[m_nbListeners - 1];
+			m_nbListeners--;
+			break;
+		}
+	}
+	m_mutex->unlock();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <SDL.h>
+
+class Mutex;
+class Condition;
+class ResumableJob;
+
+// lets a single thread sleep until a condition on lock-free state becomes
+// true. notify() is called after each state change and costs one atomic
+// load while nobody waits. The waiter's condition is evaluated by the
+// notifying thread, so the waiter is only woken when it can go on.
+// Conditions must not take locks.
+class Notifier
+{
+public:
+	Notifier();
+	~Notifier();
+
+public:
+	void wait(const std::function<bool()> &condition);
+	bool waitTimeout(const std::function<bool()> &condition, Uint32 milisec);
+	void notify();
+
+	// jobs woken on every notify(), for waiters that are not threads
+	bool addListener(ResumableJob *job);
+	void removeListener(ResumableJob *job);
+
+private:
+	enum {
+		MAX_LISTENERS = 4
+	};
+
+private:
+	std::unique_ptr<Mutex> m_mutex;
+	std::unique_ptr<Condition> m_cond;
+	std::atomic<int> m_waiters{ 0 };
+	const std::function<bool()> *m_condition = nullptr;
+	ResumableJob *m_listeners[MAX_LISTENERS] = { nullptr, };
+	std::atomic<int> m_nbListeners{ 0 };
+};
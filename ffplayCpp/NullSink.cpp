@@ -0,0 +1,40 @@
+#include "NullSink.h"
+#include "FrameQueue.h"
+#include "Thread.h"
+
+NullSink::NullSink(FrameQueue & frameQ, const char * name) :
+	Stage(name, STAGE_SINK),
+	m_frameQ(frameQ),
+	m_sinkThread(std::make_unique<Thread>(sinkThread, name, this, &m_threadStats))
+{
+	setInput(m_frameQ);
+}
+
+
+NullSink::~NullSink()
+{
+	stop();
+}
+
+void NullSink::stop()
+{
+	// the packet queue has to be aborted first, this only wakes the sink up
+	m_frameQ.signal();
+	m_sinkThread.reset();
+}
+
+int NullSink::sinkThread(void * arg)
+{
+	NullSink *sink = static_cast<NullSink *>(arg);
+	return sink->runSink();
+}
+
+int NullSink::runSink()
+{
+	while (m_frameQ.peekReadable()) {
+		m_nbFrames++;
+		m_threadStats.tick();
+		m_frameQ.next();
+	}
+	return 0;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "ThreadStats.h"
+#include "Stage.h"
+
+class FrameQueue;
+class Thread;
+
+// consumes decoded frames as fast as they arrive and throws them away
+class NullSink : public Stage
+{
+public:
+	NullSink(FrameQueue &frameQ, const char *name);
+	~NullSink();
+
+public:
+	void stop() override;
+	int64_t nbFrames() const { return m_nbFrames; }
+	const ThreadStats *threadStats() const override { return &m_threadStats; }
+	int64_t nbProcessed() const override { return m_nbFrames; }
+
+private:
+	static int sinkThread(void *arg);
+	int runSink();
+
+private:
+	FrameQueue &m_frameQ;
+	std::atomic<int64_t> m_nbFrames{ 0 };
+	ThreadStats m_threadStats;
+	std::unique_ptr<Thread> m_sinkThread;
+};
@@ -2,12 +2,26 @@
 extern "C" {
 #include <libavutil/avutil.h>
 }
+#include <cstring>
+#include <new>
 #include "Condition.h"
 #include "Mutex.h"
+#include "Notifier.h"
+#include "SpillFile.h"
 
 AVPacket PacketQueue::s_flushPkt;
 
-PacketQueue::PacketQueue() :
+static unsigned int roundUpPowerOfTwo(unsigned int value)
+{
+	unsigned int ret = 1;
+	while (ret < value) {
+		ret <<= 1;
+	}
+	return ret;
+}
+
+PacketQueue::PacketQueue(unsigned int capacity) :
+	m_capacity(roundUpPowerOfTwo(FFMAX(capacity, (unsigned int)SLOTS_PER_CHUNK))),
 	m_mutex(std::make_unique<Mutex>()),
 	m_cond(std::make_unique<Condition>())
 {
@@ -17,6 +31,8 @@ PacketQueue::PacketQueue() :
 		s_flushPkt.data = (uint8_t *)&s_flushPkt;
 	}
 
+	m_chunks.reset(new std::unique_ptr<PacketSlot[]>[m_capacity / SLOTS_PER_CHUNK]);
+
 	if (!m_mutex) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
 		// TODO : throw exception
@@ -26,135 +42,522 @@ PacketQueue::PacketQueue() :
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
 		// TODO : throw exception
 	}
-
-	m_abortRequest = 1;	
 }
 
 
 PacketQueue::~PacketQueue()
 {
+	unsigned int tail = m_tail.load();
+	for (unsigned int i = m_head.load(); i != tail; i++) {
+		releaseSlot(slotAt(i));
+	}
 }
 
-static AVPacket flushPkt;
-
 int PacketQueue::putPrivate(AVPacket * pkt)
 {
-	MyAVPacketList *pktList;
+	unsigned int tail = m_tail.load(std::memory_order_relaxed);
 
 	if (m_abortRequest) {
 		return -1;
 	}
 
-	pktList = static_cast<MyAVPacketList*>(av_malloc(sizeof(MyAVPacketList)));
-	if (!pktList) {
+	unsigned int used = tail - m_head.load(std::memory_order_acquire);
+	if (used >= m_capacity && !waitWhileFull(tail)) {
 		return -1;
 	}
+	if (static_cast<int>(used) >= m_highWater) {
+		m_highWater = used + 1;
+	}
+
+	// published to the consumer together with the tail below
+	std::unique_ptr<PacketSlot[]> &chunk = m_chunks[(tail & (m_capacity - 1)) >> CHUNK_SHIFT];
+	if (!chunk) {
+		chunk.reset(new (std::nothrow) PacketSlot[SLOTS_PER_CHUNK]);
+		if (!chunk) {
+			return -1;
+		}
+		m_nbChunks++;
+		av_log(nullptr, AV_LOG_DEBUG, "packet queue grew to %d slots\n", allocatedSlots());
+	}
+
+	PacketSlot &slot = slotAt(tail);
 	// is copy?
-	pktList->pkt = *pkt;
-	pktList->next = NULL;
-	if (pkt == &flushPkt) {
+	slot.pkt = *pkt;
+	if (pkt == &s_flushPkt) {
 		m_serial++;
 	}
-	pktList->serial = m_serial;
+	slot.serial = m_serial;
+	slot.spillOffset = -1;
+	if (m_spillThreshold && pkt != &s_flushPkt && slot.pkt.size > 0 && size64() > m_spillThreshold) {
+		spill(slot);
+	}
+	slot.footprint = packetFootprint(slot.pkt);
+
+	m_putCount.store(m_putCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (isKeyframe(slot)) {
+		m_putKeyframes.store(m_putKeyframes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	m_putSize.store(m_putSize.load(std::memory_order_relaxed) + slot.footprint, std::memory_order_relaxed);
+	m_putDuration.store(m_putDuration.load(std::memory_order_relaxed) + slot.pkt.duration, std::memory_order_relaxed);
+
+	// publishes the slot, seq_cst so that a sleeping consumer can't be missed
+	m_tail.store(tail + 1);
+	if (m_consumerWaiting) {
+		wakeUp();
+	}
+	if (m_producerNotifier) {
+		m_producerNotifier->notify();
+	}
+	return 0;
+}
 
-	if (!m_lastPkt) {
-		m_firstPkt = pktList;
+bool PacketQueue::waitWhileFull(unsigned int tail)
+{
+	m_mutex->lock();
+	m_producerWaiting = true;
+	while (!m_abortRequest && tail - m_head.load() >= m_capacity) {
+		m_cond->wait(*m_mutex);
 	}
-	else {
-		m_lastPkt->next = pktList;
+	m_producerWaiting = false;
+	m_mutex->unlock();
+
+	return !m_abortRequest;
+}
+
+bool PacketQueue::waitWhileEmpty(unsigned int head)
+{
+	m_mutex->lock();
+	m_consumerWaiting = true;
+	while (!m_abortRequest && m_tail.load() == head) {
+		m_cond->wait(*m_mutex);
 	}
-	m_lastPkt = pktList;
-	m_nbPackets++;
-	m_size += pktList->pkt.size + sizeof(*pktList);
-	m_duration += pktList->pkt.duration;
+	m_consumerWaiting = false;
+	m_mutex->unlock();
 
+	return !m_abortRequest;
+}
+
+void PacketQueue::wakeUp()
+{
+	m_mutex->lock();
 	m_cond->signal();
-	return 0;
+	m_mutex->unlock();
 }
 
-bool PacketQueue::isAbortRequested()
+bool PacketQueue::isAbortRequested() const
 {
 	return !!m_abortRequest;
 }
 
 void PacketQueue::start()
 {
-	m_mutex->lock();
 	m_abortRequest = 0;
 	putPrivate(&s_flushPkt);
+}
+
+void PacketQueue::abort()
+{
+	m_mutex->lock();
+	m_abortRequest = 1;
+	m_cond->signal();
 	m_mutex->unlock();
 }
 
+int PacketQueue::nbPackets() const
+{
+	// consumer side first, so that the difference never goes negative
+	int64_t removed = FFMAX(m_getCount.load(), m_flushedCount.load());
+	return static_cast<int>(m_putCount.load() - removed);
+}
+
+int PacketQueue::nbKeyframes() const
+{
+	int64_t removed = FFMAX(m_getKeyframes.load(), m_flushedKeyframes.load());
+	return static_cast<int>(m_putKeyframes.load() - removed);
+}
+
+int PacketQueue::size() const
+{
+	return static_cast<int>(size64());
+}
+
+int64_t PacketQueue::size64() const
+{
+	int64_t removed = FFMAX(m_getSize.load(), m_flushedSize.load());
+	return m_putSize.load() - removed;
+}
+
+int64_t PacketQueue::duration() const
+{
+	int64_t removed = FFMAX(m_getDuration.load(), m_flushedDuration.load());
+	return m_putDuration.load() - removed;
+}
+
 int PacketQueue::get(AVPacket * pkt, int block, int * serial)
 {
-	MyAVPacketList *pkt1;
-	int ret;
+	return getBatch(pkt, serial, 1, block);
+}
 
-	m_mutex->lock();
+// takes up to maxCount packets, returns how many (0 when !block and empty)
+int PacketQueue::getBatch(AVPacket * pkts, int * serials, int maxCount, int block)
+{
+	unsigned int head = m_head.load(std::memory_order_relaxed);
 
 	for (;;) {
 		if (m_abortRequest) {
-			ret = -1;
-			break;
+			return -1;
 		}
 
-		pkt1 = m_firstPkt;
-		if (pkt1) {
-			m_firstPkt = pkt1->next;
-			if (!m_firstPkt) {
-				m_lastPkt = nullptr;
+		// the flush index is stored after the tail it refers to
+		unsigned int flushIndex = m_flushIndex.load(std::memory_order_acquire);
+		if (static_cast<int>(flushIndex - head) > 0) {
+			dropPackets(head, flushIndex);
+			head = flushIndex;
+		}
+
+		// loaded before looking for a skip, so that packets queued after a
+		// skip are never handed out ahead of it
+		unsigned int tail = m_tail.load();
+
+		// an in-buffer seek starts with a flush packet of the new serial
+		if (takeSkip(head, serials)) {
+			pkts[0] = s_flushPkt;
+			return 1;
+		}
+
+		unsigned int available = tail - head;
+		if (available) {
+			int count = static_cast<int>(FFMIN(available, (unsigned int)maxCount));
+			int64_t size = m_getSize.load(std::memory_order_relaxed);
+			int64_t duration = m_getDuration.load(std::memory_order_relaxed);
+			int64_t keyframes = m_getKeyframes.load(std::memory_order_relaxed);
+
+			for (int i = 0; i < count; i++) {
+				PacketSlot &slot = slotAt(head + i);
+				pkts[i] = slot.pkt;
+				if (slot.spillOffset >= 0 && !pageIn(&pkts[i], slot)) {
+					// the rest stays queued for the next call
+					if (!i) {
+						return -1;
+					}
+					count = i;
+					break;
+				}
+				if (serials) {
+					serials[i] = slot.serial;
+				}
+				if (m_restamping) {
+					if (static_cast<int>(m_restampEnd - (head + i)) > 0) {
+						if (serials) {
+							serials[i] = m_restampSerial;
+						}
+					}
+					else {
+						m_restamping = false;
+					}
+				}
+				size += slot.footprint;
+				duration += slot.pkt.duration;
+				keyframes += isKeyframe(slot);
 			}
-			m_nbPackets--;
-			m_size -= pkt1->pkt.size + sizeof(*pkt1);
-			m_duration -= pkt1->pkt.duration;
-			*pkt = pkt1->pkt;
-			if (serial) {
-				*serial = pkt1->serial;
+
+			m_getCount.store(m_getCount.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+			m_getSize.store(size, std::memory_order_relaxed);
+			m_getDuration.store(duration, std::memory_order_relaxed);
+			m_getKeyframes.store(keyframes, std::memory_order_relaxed);
+			m_getBatches.store(m_getBatches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			m_getBatchPackets.store(m_getBatchPackets.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+
+			// hands the slots back to the producer
+			m_head.store(head + count);
+			if (m_producerWaiting) {
+				wakeUp();
 			}
-			av_free(pkt1);
-			ret = 1;
-			break;
+			if (m_consumerNotifier) {
+				m_consumerNotifier->notify();
+			}
+			return count;
 		}
 		else if (!block) {
-			ret = 0;
+			return 0;
+		}
+		else if (!waitWhileEmpty(head)) {
+			return -1;
+		}
+	}
+}
+
+void PacketQueue::dropPackets(unsigned int head, unsigned int end)
+{
+	int64_t count = m_getCount.load(std::memory_order_relaxed);
+	int64_t size = m_getSize.load(std::memory_order_relaxed);
+	int64_t duration = m_getDuration.load(std::memory_order_relaxed);
+	int64_t keyframes = m_getKeyframes.load(std::memory_order_relaxed);
+
+	for (unsigned int i = head; i != end; i++) {
+		PacketSlot &slot = slotAt(i);
+		count++;
+		size += slot.footprint;
+		duration += slot.pkt.duration;
+		keyframes += isKeyframe(slot);
+		releaseSlot(slot);
+	}
+
+	m_getCount.store(count, std::memory_order_relaxed);
+	m_getSize.store(size, std::memory_order_relaxed);
+	m_getDuration.store(duration, std::memory_order_relaxed);
+	m_getKeyframes.store(keyframes, std::memory_order_relaxed);
+
+	m_head.store(end);
+	if (m_producerWaiting) {
+		wakeUp();
+	}
+	if (m_consumerNotifier) {
+		m_consumerNotifier->notify();
+	}
+}
+
+// called from the consumer when it is too late to decode what is queued.
+// drops every packet before the next queued keyframe, returns how many
+int PacketQueue::dropToKeyframe()
+{
+	unsigned int head = m_head.load(std::memory_order_relaxed);
+
+	// a pending flush or skip is handled by the next get() instead
+	if (!nbKeyframes() ||
+		static_cast<int>(m_flushIndex.load(std::memory_order_acquire) - head) > 0 ||
+		m_skipSeq.load(std::memory_order_acquire) != m_skipHandled) {
+		return 0;
+	}
+
+	unsigned int tail = m_tail.load();
+	for (unsigned int i = head; i != tail; i++) {
+		const PacketSlot &slot = slotAt(i);
+		if (slot.pkt.data == s_flushPkt.data) {
 			break;
 		}
-		else {
-			m_cond->wait(*m_mutex);
+		if (isKeyframe(slot)) {
+			if (i != head) {
+				dropPackets(head, i);
+			}
+			return static_cast<int>(i - head);
 		}
 	}
-	m_mutex->unlock();
-	return ret;
+	return 0;
 }
 
-void PacketQueue::flush()
+// consumer side of skipTo(). drops the packets before the seek point and
+// returns true when the caller has to emit a flush packet with *serial
+bool PacketQueue::takeSkip(unsigned int & head, int * serial)
 {
-	MyAVPacketList *pkt, *pkt1;
+	unsigned int seq, index, end;
+	int skipSerial;
 
-	m_mutex->lock();
-	for (pkt = m_firstPkt; pkt; pkt = pkt1) {
-		pkt1 = pkt->next;
-		av_packet_unref(&pkt->pkt);
-		av_freep(&pkt);
+	for (;;) {
+		seq = m_skipSeq.load(std::memory_order_acquire);
+		if (seq & 1) {
+			// the producer is in the middle of skipTo()
+			continue;
+		}
+		if (seq == m_skipHandled) {
+			return false;
+		}
+
+		index = m_skipIndex.load(std::memory_order_relaxed);
+		end = m_skipEnd.load(std::memory_order_relaxed);
+		skipSerial = m_skipSerial.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_skipSeq.load(std::memory_order_relaxed) == seq) {
+			break;
+		}
 	}
-	m_lastPkt = nullptr;
-	m_firstPkt = nullptr;
-	m_nbPackets = 0;
-	m_size = 0;
-	m_duration = 0;
+	m_skipHandled = seq;
 
-	m_mutex->unlock();
+	// already consumed or superseded by a flush
+	if (static_cast<int>(end - head) <= 0) {
+		return false;
+	}
+
+	// the seek point was taken before the request was seen, resume at the
+	// next keyframe instead
+	if (static_cast<int>(head - index) > 0) {
+		for (index = head; index != end; index++) {
+			if (slotAt(index).pkt.flags & AV_PKT_FLAG_KEY) {
+				break;
+			}
+		}
+	}
+
+	if (index != head) {
+		dropPackets(head, index);
+		head = index;
+	}
+
+	m_restampEnd = end;
+	m_restampSerial = skipSerial;
+	m_restamping = true;
+	if (serial) {
+		*serial = skipSerial;
+	}
+	return true;
+}
+
+// first packet the consumer will still see, for the producer
+unsigned int PacketQueue::queuedBegin() const
+{
+	unsigned int head = m_head.load(std::memory_order_acquire);
+	unsigned int flushIndex = m_flushIndex.load(std::memory_order_relaxed);
+	return static_cast<int>(flushIndex - head) > 0 ? flushIndex : head;
+}
+
+// last keyframe with a timestamp in [minTs, target], provided the queue
+// also holds packets at or past target
+bool PacketQueue::findSeekPoint(int64_t minTs, int64_t target, unsigned int * index) const
+{
+	unsigned int tail = m_tail.load(std::memory_order_relaxed);
+	bool found = false;
+
+	// slots are only rewritten by the producer, so their metadata can be
+	// read even while the consumer moves past them
+	for (unsigned int i = queuedBegin(); i != tail; i++) {
+		const AVPacket &pkt = slotAt(i).pkt;
+		int64_t ts = packetTs(pkt);
+		if (ts == AV_NOPTS_VALUE) {
+			continue;
+		}
+		if (ts >= target && found) {
+			return true;
+		}
+		if (ts <= target && ts >= minTs && (pkt.flags & AV_PKT_FLAG_KEY)) {
+			*index = i;
+			found = true;
+		}
+	}
+	return false;
+}
+
+unsigned int PacketQueue::findFirstAfter(int64_t ts) const
+{
+	unsigned int tail = m_tail.load(std::memory_order_relaxed);
+	unsigned int i;
+
+	for (i = queuedBegin(); i != tail; i++) {
+		int64_t pktTs = packetTs(slotAt(i).pkt);
+		if (pktTs != AV_NOPTS_VALUE && pktTs >= ts) {
+			break;
+		}
+	}
+	return i;
+}
+
+// starts a new serial at index without flushing the queued packets after it
+void PacketQueue::skipTo(unsigned int index)
+{
+	unsigned int seq = m_skipSeq.load(std::memory_order_relaxed);
+	int serial = ++m_serial;
+
+	m_skipSeq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	m_skipIndex.store(index, std::memory_order_relaxed);
+	m_skipEnd.store(m_tail.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	m_skipSerial.store(serial, std::memory_order_relaxed);
+	m_skipSeq.store(seq + 2, std::memory_order_release);
+}
+
+// the slot itself is left untouched, the producer may still be reading
+// its timestamps
+void PacketQueue::releaseSlot(PacketSlot & slot)
+{
+	if (slot.pkt.data != s_flushPkt.data) {
+		AVPacket pkt = slot.pkt;
+		av_packet_unref(&pkt);
+	}
+	if (slot.spillOffset >= 0) {
+		m_spillFile->release(slot.spillOffset);
+		m_spilledSize -= slot.pkt.size;
+	}
+}
+
+// what the packet really keeps allocated, a spilled payload counts for nothing
+int PacketQueue::packetFootprint(const AVPacket & pkt)
+{
+	int bytes = sizeof(PacketSlot);
+	if (pkt.buf) {
+		bytes += pkt.buf->size;
+	}
+	else if (pkt.data) {
+		bytes += pkt.size;
+	}
+	for (int i = 0; i < pkt.side_data_elems; i++) {
+		bytes += sizeof(*pkt.side_data) + pkt.side_data[i].size;
+	}
+	return bytes;
+}
+
+// moves the payload of a slot that is about to be published to the spill
+// file. the side data is small and stays in memory
+void PacketQueue::spill(PacketSlot & slot)
+{
+	if (!m_spillFile) {
+		m_spillFile.reset(new (std::nothrow) SpillFile());
+		if (!m_spillFile || !m_spillFile->open()) {
+			av_log(nullptr, AV_LOG_WARNING, "packets are kept in memory\n");
+			m_spillFile.reset();
+			m_spillThreshold = 0;
+			return;
+		}
+	}
+
+	int64_t offset = m_spillFile->write(slot.pkt.data, slot.pkt.size);
+	if (offset < 0) {
+		return;
+	}
+	av_buffer_unref(&slot.pkt.buf);
+	slot.pkt.data = nullptr;
+	slot.spillOffset = offset;
+
+	int64_t spilledSize = m_spilledSize += slot.pkt.size;
+	if (spilledSize > m_peakSpilledSize.load(std::memory_order_relaxed)) {
+		m_peakSpilledSize.store(spilledSize, std::memory_order_relaxed);
+	}
+}
+
+// reads a spilled payload back into a fresh buffer owned by pkt
+bool PacketQueue::pageIn(AVPacket * pkt, const PacketSlot & slot)
+{
+	AVBufferRef *buf = av_buffer_alloc(slot.pkt.size + AV_INPUT_BUFFER_PADDING_SIZE);
+	if (!buf) {
+		av_log(nullptr, AV_LOG_ERROR, "could not read back a spilled packet\n");
+		return false;
+	}
+	m_spillFile->read(slot.spillOffset, buf->data, slot.pkt.size);
+	memset(buf->data + slot.pkt.size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	pkt->buf = buf;
+	pkt->data = buf->data;
+
+	m_spillFile->release(slot.spillOffset);
+	m_spilledSize -= slot.pkt.size;
+	return true;
+}
+
+// called from the producer. the consumer drops the flushed packets on its
+// next get(), the accounting forgets them immediately.
+void PacketQueue::flush()
+{
+	m_flushedCount = m_putCount.load(std::memory_order_relaxed);
+	m_flushedKeyframes = m_putKeyframes.load(std::memory_order_relaxed);
+	m_flushedSize = m_putSize.load(std::memory_order_relaxed);
+	m_flushedDuration = m_putDuration.load(std::memory_order_relaxed);
+	m_flushIndex.store(m_tail.load(std::memory_order_relaxed), std::memory_order_release);
 }
 
 int PacketQueue::put(AVPacket * pkt)
 {
 	int ret;
 
-	m_mutex->lock();
 	ret = putPrivate(pkt);
-	m_mutex->unlock();
 
-	if (pkt != &flushPkt && ret < 0) {
+	if (pkt != &s_flushPkt && ret < 0) {
 		av_packet_unref(pkt);
 	}
 
@@ -176,14 +579,15 @@ int PacketQueue::putNullPkt(int streamIndex)
 	return put(pkt);
 }
 
-int PacketQueue::hasEnoughPackets(AVStream * st, int streamId)
+int PacketQueue::hasEnoughPackets(AVStream * st, int streamId, double minDuration) const
 {
 	const int MIN_FRAMES = 25;
+	int64_t queueDuration = duration();
 	return ( (streamId < 0) || 
 		m_abortRequest ||
 		(st->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
-		((m_nbPackets > MIN_FRAMES) && 
-		(!m_duration || av_q2d(st->time_base) * m_duration > 1.0) ));
+		((nbPackets() > MIN_FRAMES) && 
+		(!queueDuration || av_q2d(st->time_base) * queueDuration > minDuration) ));
 }
 
 bool PacketQueue::isFlushData(uint8_t *& data)
@@ -4,53 +4,170 @@ extern "C"	{
 #include <libavformat/avformat.h>
 }
 #include <SDL.h>
+#include <atomic>
 #include <memory>
 
 class Condition;
 class Mutex;
+class Notifier;
+class SpillFile;
 
-struct MyAVPacketList
+struct PacketSlot
 {
 	AVPacket pkt;
-	struct MyAVPacketList *next;
 	int serial;
+	// bytes the packet holds in memory, buffers as allocated plus the slot
+	int footprint;
+	// where the payload went when it was spilled to disk, -1 when in memory
+	int64_t spillOffset;
 };
 
+// bounded single-producer(read thread)/single-consumer(decoder) ring.
+// the mutex is only taken when one side has to sleep on an empty or full ring.
 class PacketQueue
 {
 public:
-	PacketQueue();
+	explicit PacketQueue(unsigned int capacity = DEFAULT_CAPACITY);
 	~PacketQueue();
 
+public:
+	enum {
+		DEFAULT_CAPACITY = 4096,	// rounded up to a power of two
+		TIMESHIFT_CAPACITY = 1 << 19,	// hours of packets, slots still come chunk by chunk
+		CHUNK_SHIFT = 6,
+		SLOTS_PER_CHUNK = 1 << CHUNK_SHIFT,
+		CACHE_LINE_SIZE = 64
+	};
+
 public:
 	bool isSameSerial(int serial) const {
 		return serial == m_serial;
 	}
 
 public:
-	int putPrivate(AVPacket *pkt);
-	bool isAbortRequested();	
+	bool isAbortRequested() const;
 	void start();
-	int nbPackets() const { return m_nbPackets; }
+	void abort();
+	int nbPackets() const;
+	int nbKeyframes() const;
 	int get(AVPacket *pkt, int block, int *serial);
+	int getBatch(AVPacket *pkts, int *serials, int maxCount, int block);
+	int dropToKeyframe();
 	void flush();
 	int put(AVPacket *pkt);
 	int putFlushPkt();
 	int putNullPkt(int streamIndex);
-	int size() { return m_size; }
-	int hasEnoughPackets(AVStream *st, int streamId);
+	int size() const;
+	// exact footprint, a timeshift buffer outgrows int
+	int64_t size64() const;
+	int64_t duration() const;
+	int hasEnoughPackets(AVStream *st, int streamId, double minDuration) const;
 	static bool isFlushData(uint8_t* &data);
 
+	// in-buffer seeking, called from the producer. timestamps are in the
+	// stream time base, indexes are ring positions
+	bool findSeekPoint(int64_t minTs, int64_t target, unsigned int *index) const;
+	unsigned int findFirstAfter(int64_t ts) const;
+	void skipTo(unsigned int index);
+
+	// payloads queued beyond threshold bytes go to a temporary file and are
+	// read back on get(), 0 keeps everything in memory. called from the producer
+	void setSpillThreshold(int64_t threshold) { m_spillThreshold = threshold; }
+
+	// notified each time the consumer frees slots
+	void setConsumerNotifier(Notifier *notifier) { m_consumerNotifier = notifier; }
+	// notified each time the producer queues a packet
+	void setProducerNotifier(Notifier *notifier) { m_producerNotifier = notifier; }
+
+	// slot storage statistics, for sizing the ring
+	int allocatedSlots() const { return m_nbChunks * SLOTS_PER_CHUNK; }
+	int highWaterPackets() const { return m_highWater; }
+	double averageGetBatch() const {
+		int64_t batches = m_getBatches.load(std::memory_order_relaxed);
+		return batches ? (double)m_getBatchPackets.load(std::memory_order_relaxed) / batches : 0.0;
+	}
+	int64_t peakSpilledSize() const { return m_peakSpilledSize; }
+
+private:
+	int putPrivate(AVPacket *pkt);
+	bool waitWhileFull(unsigned int tail);
+	bool waitWhileEmpty(unsigned int head);
+	void wakeUp();
+	void dropPackets(unsigned int head, unsigned int end);
+	bool takeSkip(unsigned int &head, int *serial);
+	unsigned int queuedBegin() const;
+	void releaseSlot(PacketSlot &slot);
+	void spill(PacketSlot &slot);
+	bool pageIn(AVPacket *pkt, const PacketSlot &slot);
+	static int packetFootprint(const AVPacket &pkt);
+	static bool isKeyframe(const PacketSlot &slot) {
+		return !!(slot.pkt.flags & AV_PKT_FLAG_KEY);
+	}
+	static int64_t packetTs(const AVPacket &pkt) {
+		return pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts;
+	}
+	PacketSlot &slotAt(unsigned int index) const {
+		index &= m_capacity - 1;
+		return m_chunks[index >> CHUNK_SHIFT][index & (SLOTS_PER_CHUNK - 1)];
+	}
+
 private:
-	MyAVPacketList *m_firstPkt = nullptr;
-	MyAVPacketList *m_lastPkt = nullptr;
-	int m_nbPackets = 0;
-	int m_size = 0;
-	int64_t m_duration = 0;
-	int m_abortRequest = 0;
-	int m_serial = 0;
+	// slots are allocated chunk by chunk by the producer the first time the
+	// ring reaches them, and are kept until the queue is destroyed
+	std::unique_ptr<std::unique_ptr<PacketSlot[]>[]> m_chunks;
+	unsigned int m_capacity = 0;
+	std::atomic<int> m_nbChunks{ 0 };
+	std::atomic<int> m_highWater{ 0 };
+	std::atomic<int> m_abortRequest{ 1 };
+	std::atomic<int> m_serial{ 0 };
 	std::unique_ptr<Mutex> m_mutex;
 	std::unique_ptr<Condition> m_cond;
+	Notifier *m_consumerNotifier = nullptr;
+	Notifier *m_producerNotifier = nullptr;
+	// created by the producer on the first spill, before the slot is published
+	std::unique_ptr<SpillFile> m_spillFile;
+	std::atomic<int64_t> m_spilledSize{ 0 };
 	static AVPacket s_flushPkt;
-};
 
+	char m_sharedPad[CACHE_LINE_SIZE];
+
+	// written by the producer only. the totals are cumulative, the queue
+	// content is the difference between put and got (or flushed) totals
+	std::atomic<unsigned int> m_tail{ 0 };
+	std::atomic<unsigned int> m_flushIndex{ 0 };
+	std::atomic<int64_t> m_putCount{ 0 };
+	std::atomic<int64_t> m_putSize{ 0 };
+	std::atomic<int64_t> m_putDuration{ 0 };
+	std::atomic<int64_t> m_flushedCount{ 0 };
+	std::atomic<int64_t> m_putKeyframes{ 0 };
+	std::atomic<int64_t> m_flushedKeyframes{ 0 };
+	std::atomic<int64_t> m_flushedSize{ 0 };
+	std::atomic<int64_t> m_flushedDuration{ 0 };
+	std::atomic<bool> m_producerWaiting{ false };
+	// skip request, odd m_skipSeq while it is being written
+	std::atomic<unsigned int> m_skipSeq{ 0 };
+	std::atomic<unsigned int> m_skipIndex{ 0 };
+	std::atomic<unsigned int> m_skipEnd{ 0 };
+	std::atomic<int> m_skipSerial{ 0 };
+	int64_t m_spillThreshold = 0;
+	std::atomic<int64_t> m_peakSpilledSize{ 0 };
+
+	char m_producerPad[CACHE_LINE_SIZE];
+
+	// written by the consumer only
+	std::atomic<unsigned int> m_head{ 0 };
+	std::atomic<int64_t> m_getCount{ 0 };
+	std::atomic<int64_t> m_getKeyframes{ 0 };
+	std::atomic<int64_t> m_getSize{ 0 };
+	std::atomic<int64_t> m_getDuration{ 0 };
+	std::atomic<int64_t> m_getBatches{ 0 };
+	std::atomic<int64_t> m_getBatchPackets{ 0 };
+	std::atomic<bool> m_consumerWaiting{ false };
+	// packets queued before a skip are handed out with the skip serial
+	unsigned int m_skipHandled = 0;
+	unsigned int m_restampEnd = 0;
+	int m_restampSerial = 0;
+	bool m_restamping = false;
+
+	char m_consumerPad[CACHE_LINE_SIZE];
+};
@@ -0,0 +1,68 @@
+#include "PipelineGraph.h"
+extern "C" {
+#include <libavutil/log.h>
+}
+#include "Mutex.h"
+
+PipelineGraph::PipelineGraph() :
+	m_mutex(std::make_unique<Mutex>())
+{
+}
+
+
+PipelineGraph::~PipelineGraph()
+{
+}
+
+bool PipelineGraph::add(Stage & stage, Stage * upstream)
+{
+	bool added = false;
+
+	m_mutex->lock();
+	if (m_nbNodes < MAX_STAGES) {
+		m_nodes[m_nbNodes++] = { &stage, upstream };
+		added = true;
+	}
+	m_mutex->unlock();
+
+	if (!added) {
+		av_log(nullptr, AV_LOG_ERROR, "pipeline: no room for %s stage %s\n", Stage::kindName(stage.kind()), stage.name());
+		return false;
+	}
+	av_log(nullptr, AV_LOG_DEBUG, "pipeline: %s stage %s after %s\n",
+		Stage::kindName(stage.kind()), stage.name(), upstream ? upstream->name() : "none");
+	return true;
+}
+
+void PipelineGraph::connect(const Stage & stage, Stage & upstream)
+{
+	m_mutex->lock();
+	for (int i = 0; i < m_nbNodes; i++) {
+		if (m_nodes[i].stage == &stage) {
+			m_nodes[i].upstream = &upstream;
+		}
+	}
+	m_mutex->unlock();
+}
+
+int PipelineGraph::nodes(Node * nodes) const
+{
+	m_mutex->lock();
+	int nbNodes = m_nbNodes;
+	for (int i = 0; i < nbNodes; i++) {
+		nodes[i] = m_nodes[i];
+	}
+	m_mutex->unlock();
+	return nbNodes;
+}
+
+void PipelineGraph::stop()
+{
+	Node nodes[MAX_STAGES];
+	int nbNodes = this->nodes(nodes);
+
+	// stopping a stage waits for its thread, so not under the lock
+	for (int i = 0; i < nbNodes; i++) {
+		nodes[i].stage->stop();
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include "Stage.h"
+
+class Mutex;
+
+// the stages of one VideoState and who feeds whom. stages are added from the
+// sources down as streams open and may be listed from any thread, the graph
+// doesn't own them. adding a converter or another sink is one add() with
+// the stage it reads from.
+class PipelineGraph
+{
+public:
+	PipelineGraph();
+	~PipelineGraph();
+
+public:
+	enum {
+		MAX_STAGES = 16
+	};
+
+	struct Node
+	{
+		Stage *stage;
+		Stage *upstream;
+	};
+
+public:
+	bool add(Stage &stage, Stage *upstream = nullptr);
+	// for a stage added before what feeds it
+	void connect(const Stage &stage, Stage &upstream);
+	// copies the stages in the order they were added, returns how many
+	int nodes(Node *nodes) const;
+	// stops every stage, the sources first so that nobody waits on a queue
+	void stop();
+
+private:
+	std::unique_ptr<Mutex> m_mutex;
+	Node m_nodes[MAX_STAGES];
+	int m_nbNodes = 0;
+};
@@ -0,0 +1,85 @@
+#include "ResumableJob.h"
+
+ResumableJob::ResumableJob(std::function<Result()> step) :
+	m_step(std::move(step)),
+	m_group(TaskPool::instance())
+{
+}
+
+
+ResumableJob::~ResumableJob()
+{
+	join();
+}
+
+void ResumableJob::start()
+{
+	wake();
+}
+
+void ResumableJob::wake()
+{
+	int state = m_state.load();
+
+	for (;;) {
+		if (state == STATE_SUSPENDED) {
+			if (m_state.compare_exchange_weak(state, STATE_QUEUED)) {
+				schedule();
+				return;
+			}
+		}
+		else if (state == STATE_RUNNING) {
+			if (m_state.compare_exchange_weak(state, STATE_WOKEN)) {
+				return;
+			}
+		}
+		else {
+			// queued, already woken or done
+			return;
+		}
+	}
+}
+
+// the step that returned RESULT_DONE still runs in a task of m_group, so the
+// group is waited for once more after the state says done
+void ResumableJob::join()
+{
+	int state;
+
+	do {
+		state = m_state.load();
+		if (state != STATE_DONE) {
+			wake();
+		}
+		m_group.wait();
+	} while (state != STATE_DONE);
+}
+
+void ResumableJob::schedule()
+{
+	m_group.run([this] { run(); });
+}
+
+void ResumableJob::run()
+{
+	m_state = STATE_RUNNING;
+
+	switch (m_step()) {
+	case RESULT_YIELD:
+		m_state = STATE_QUEUED;
+		schedule();
+		break;
+	case RESULT_SUSPEND: {
+		int state = STATE_RUNNING;
+		if (!m_state.compare_exchange_strong(state, STATE_SUSPENDED)) {
+			// woken while running, what it waited for may be there already
+			m_state = STATE_QUEUED;
+			schedule();
+		}
+		break;
+	}
+	case RESULT_DONE:
+		m_state = STATE_DONE;
+		break;
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include "TaskPool.h"
+
+// a pipeline step that runs on the task pool instead of a thread of its own.
+// step() does a bounded amount of work and returns where a thread would
+// block, wake() runs it again once what it waits for may have changed.
+class ResumableJob
+{
+public:
+	enum Result {
+		RESULT_YIELD,		// more to do, let the other jobs run first
+		RESULT_SUSPEND,		// nothing to do until wake()
+		RESULT_DONE
+	};
+
+public:
+	explicit ResumableJob(std::function<Result()> step);
+	~ResumableJob();
+
+public:
+	void start();
+	// from any thread, a wake-up while step() runs makes it run once more
+	void wake();
+	// returns once step() returned RESULT_DONE, which it must do when woken
+	void join();
+
+private:
+	enum State {
+		STATE_SUSPENDED,
+		STATE_QUEUED,
+		STATE_RUNNING,
+		STATE_WOKEN,
+		STATE_DONE
+	};
+
+private:
+	void run();
+	void schedule();
+
+private:
+	std::function<Result()> m_step;
+	std::atomic<int> m_state{ STATE_SUSPENDED };
+	TaskGroup m_group;
+};
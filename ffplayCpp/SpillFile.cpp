@@ -0,0 +1,173 @@
+#include "SpillFile.h"
+extern "C" {
+#include <libavutil/log.h>
+}
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "Mutex.h"
+
+SpillFile::SpillFile() :
+	m_mutex(std::make_unique<Mutex>())
+{
+}
+
+
+SpillFile::~SpillFile()
+{
+	for (Segment &segment : m_segments) {
+		unmapSegment(segment);
+	}
+#ifdef _WIN32
+	if (m_file) {
+		CloseHandle(m_file);
+	}
+#else
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+#endif
+}
+
+// the file has no name once opened and goes away with the process
+bool SpillFile::open()
+{
+#ifdef _WIN32
+	char dir[MAX_PATH];
+	char path[MAX_PATH];
+	if (!GetTempPathA(MAX_PATH, dir) || !GetTempFileNameA(dir, "ffq", 0, path)) {
+		av_log(nullptr, AV_LOG_ERROR, "could not name a packet spill file\n");
+		return false;
+	}
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		av_log(nullptr, AV_LOG_ERROR, "could not create packet spill file %s\n", path);
+		return false;
+	}
+	m_file = file;
+#else
+	const char *dir = getenv("TMPDIR");
+	std::string path = std::string(dir ? dir : "/tmp") + "/ffplayCpp-XXXXXX";
+	int fd = mkstemp(&path[0]);
+	if (fd < 0) {
+		av_log(nullptr, AV_LOG_ERROR, "could not create packet spill file %s\n", path.c_str());
+		return false;
+	}
+	unlink(path.c_str());
+	m_fd = fd;
+#endif
+	return true;
+}
+
+// called from the producer
+int64_t SpillFile::write(const uint8_t * data, int size)
+{
+	if (size > SEGMENT_SIZE) {
+		return -1;
+	}
+
+	m_mutex->lock();
+	if (m_writeSegment < 0 || m_segments[m_writeSegment].used + size > SEGMENT_SIZE) {
+		if (m_writeSegment >= 0 && !m_segments[m_writeSegment].live) {
+			m_segments[m_writeSegment].used = 0;
+			m_freeSegments.push_back(m_writeSegment);
+		}
+		if (m_freeSegments.empty() && !mapSegment()) {
+			m_writeSegment = -1;
+			m_mutex->unlock();
+			return -1;
+		}
+		m_writeSegment = m_freeSegments.back();
+		m_freeSegments.pop_back();
+	}
+
+	Segment &segment = m_segments[m_writeSegment];
+	int position = segment.used;
+	uint8_t *base = segment.base;
+	segment.used += size;
+	segment.live++;
+	int64_t offset = static_cast<int64_t>(m_writeSegment) * SEGMENT_SIZE + position;
+	m_mutex->unlock();
+
+	// the reader only gets the offset after the packet is published
+	memcpy(base + position, data, size);
+	return offset;
+}
+
+// called from the consumer
+void SpillFile::read(int64_t offset, uint8_t * data, int size)
+{
+	m_mutex->lock();
+	uint8_t *base = m_segments[static_cast<size_t>(offset / SEGMENT_SIZE)].base;
+	m_mutex->unlock();
+
+	memcpy(data, base + offset % SEGMENT_SIZE, size);
+}
+
+// called from the consumer
+void SpillFile::release(int64_t offset)
+{
+	int index = static_cast<int>(offset / SEGMENT_SIZE);
+
+	m_mutex->lock();
+	Segment &segment = m_segments[index];
+	if (!--segment.live && index != m_writeSegment) {
+		segment.used = 0;
+		m_freeSegments.push_back(index);
+	}
+	m_mutex->unlock();
+}
+
+// grows the file by one segment, with the mutex held
+bool SpillFile::mapSegment()
+{
+	Segment segment = { nullptr, 0, 0 };
+	int64_t offset = fileSize();
+	int64_t end = offset + SEGMENT_SIZE;
+
+#ifdef _WIN32
+	// a mapping object can't outgrow the size it was created with
+	segment.mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(end >> 32), static_cast<DWORD>(end), nullptr);
+	if (segment.mapping) {
+		segment.base = static_cast<uint8_t *>(MapViewOfFile(segment.mapping, FILE_MAP_ALL_ACCESS,
+			static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), SEGMENT_SIZE));
+		if (!segment.base) {
+			CloseHandle(segment.mapping);
+		}
+	}
+#else
+	if (!ftruncate(m_fd, end)) {
+		void *base = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+		if (base != MAP_FAILED) {
+			segment.base = static_cast<uint8_t *>(base);
+		}
+	}
+#endif
+	if (!segment.base) {
+		av_log(nullptr, AV_LOG_ERROR, "could not grow packet spill file to %lld bytes\n", (long long)end);
+		return false;
+	}
+
+	m_segments.push_back(segment);
+	m_freeSegments.push_back(static_cast<int>(m_segments.size()) - 1);
+	av_log(nullptr, AV_LOG_DEBUG, "packet spill file grew to %lld bytes\n", (long long)end);
+	return true;
+}
+
+void SpillFile::unmapSegment(Segment & segment)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(segment.base);
+	CloseHandle(segment.mapping);
+#else
+	munmap(segment.base, SEGMENT_SIZE);
+#endif
+}
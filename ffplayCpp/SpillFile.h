@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Mutex;
+
+// anonymous temporary file, mapped segment by segment, that holds packet
+// payloads a PacketQueue can't keep in memory. one thread writes and one
+// thread reads, payloads are read back in the order they were written.
+// segments are reused once every payload in them has been released.
+class SpillFile
+{
+public:
+	SpillFile();
+	~SpillFile();
+
+public:
+	enum {
+		SEGMENT_SIZE = 16 * 1024 * 1024	// a multiple of the mapping granularity
+	};
+
+public:
+	bool open();
+	// returns the file offset of the copy, or -1
+	int64_t write(const uint8_t *data, int size);
+	void read(int64_t offset, uint8_t *data, int size);
+	void release(int64_t offset);
+	int64_t fileSize() const { return static_cast<int64_t>(m_segments.size()) * SEGMENT_SIZE; }
+
+private:
+	struct Segment
+	{
+		uint8_t *base;
+		int used;
+		int live;
+#ifdef _WIN32
+		void *mapping;
+#endif
+	};
+
+private:
+	bool mapSegment();
+	void unmapSegment(Segment &segment);
+
+private:
+	std::unique_ptr<Mutex> m_mutex;
+	std::vector<Segment> m_segments;
+	std::vector<int> m_freeSegments;
+	int m_writeSegment = -1;
+#ifdef _WIN32
+	void *m_file = nullptr;
+#else
+	int m_fd = -1;
+#endif
+};
@@ -0,0 +1,60 @@
+#include "Stage.h"
+#include "PacketQueue.h"
+#include "FrameQueue.h"
+
+Stage::Stage(const char * name, Kind kind) :
+	m_name(name),
+	m_kind(kind)
+{
+}
+
+
+Stage::~Stage()
+{
+}
+
+void Stage::setInput(const PacketQueue & queue)
+{
+	m_packetInput = &queue;
+	m_frameInput = nullptr;
+}
+
+void Stage::setInput(const FrameQueue & queue)
+{
+	m_frameInput = &queue;
+	m_packetInput = nullptr;
+}
+
+int Stage::nbQueued() const
+{
+	if (m_packetInput) {
+		return m_packetInput->nbPackets();
+	}
+	return m_frameInput ? m_frameInput->remaining() : 0;
+}
+
+const char * Stage::kindName(Kind kind)
+{
+	switch (kind) {
+	case STAGE_SOURCE:
+		return "source";
+	case STAGE_DECODER:
+		return "decoder";
+	case STAGE_CONVERTER:
+		return "converter";
+	case STAGE_SINK:
+		return "sink";
+	}
+	return "?";
+}
+
+ExternalStage::ExternalStage(const char * name, Kind kind, const ThreadStats & stats) :
+	Stage(name, kind),
+	m_stats(stats)
+{
+}
+
+
+ExternalStage::~ExternalStage()
+{
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+class ThreadStats;
+class PacketQueue;
+class FrameQueue;
+
+// one step of the playback pipeline. a stage takes packets or frames from
+// the bounded queue upstream of it and hands its output to the queue of the
+// next stage, on a thread of its own or on one it is called from.
+class Stage
+{
+public:
+	enum Kind {
+		STAGE_SOURCE,
+		STAGE_DECODER,
+		STAGE_CONVERTER,
+		STAGE_SINK
+	};
+
+public:
+	Stage(const char *name, Kind kind);
+	virtual ~Stage();
+
+public:
+	const char *name() const { return m_name; }
+	Kind kind() const { return m_kind; }
+
+	// nullptr until the stage runs
+	virtual const ThreadStats *threadStats() const = 0;
+	// packets or frames produced, or consumed by a sink
+	virtual int64_t nbProcessed() const = 0;
+	// the bounded queue the stage reads from, none for a source or a stage
+	// handed its input by the one before it
+	void setInput(const PacketQueue &queue);
+	void setInput(const FrameQueue &queue);
+	// waiting in that queue
+	int nbQueued() const;
+	// stops the thread of the stage, called from the sources down
+	virtual void stop() {}
+
+	static const char *kindName(Kind kind);
+
+private:
+	const char *m_name;
+	Kind m_kind;
+	const PacketQueue *m_packetInput = nullptr;
+	const FrameQueue *m_frameInput = nullptr;
+};
+
+// a stage run by code outside of it, the read loop, the audio callback of
+// SDL or the refresh loop, which reports its work here
+class ExternalStage : public Stage
+{
+public:
+	ExternalStage(const char *name, Kind kind, const ThreadStats &stats);
+	~ExternalStage();
+
+public:
+	// called from the thread running the stage
+	void setRunning() { m_running = true; }
+	void count(int n = 1) { m_processed.store(m_processed.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+	const ThreadStats *threadStats() const override { return m_running ? &m_stats : nullptr; }
+	int64_t nbProcessed() const override { return m_processed; }
+
+private:
+	const ThreadStats &m_stats;
+	std::atomic<bool> m_running{ false };
+	std::atomic<int64_t> m_processed{ 0 };
+};
@@ -1,12 +1,13 @@
 #include "SwScaleContext.h"
-
-SwScaleContext::SwScaleContext() :
-	m_context(nullptr)
-{
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/pixdesc.h>
 }
+#include "TaskPool.h"
+#include "ColorConverter.h"
 
-SwScaleContext::SwScaleContext(SwsContext * context) :
-	m_context(context)
+SwScaleContext::SwScaleContext(int maxSlices) :
+	m_maxSlices(FFMAX(maxSlices, 1))
 {
 }
 
@@ -17,19 +18,157 @@ SwScaleContext::~SwScaleContext()
 
 int SwScaleContext::scale(const uint8_t * const * data, const int * srcStride, int srcSliceY, int srcSliceH, uint8_t * const * dst, const int * dstStride)
 {
-	return sws_scale(m_context.get(), data, srcStride, srcSliceY, srcSliceH, dst, dstStride);
+	if (m_cache.empty()) {
+		return 0;
+	}
+
+	const Entry &entry = m_cache.front();
+	if (entry.native) {
+		if (srcSliceY == 0 && srcSliceH == entry.srcHeight) {
+			return convertSlices(entry, data, srcStride, dst[0], dstStride[0]);
+		}
+		// data points to the slice, dst to the picture
+		ColorConverter::convert(entry.srcFormat, data, srcStride, entry.srcWidth, 0, srcSliceH,
+			dst[0] + dstStride[0] * srcSliceY, dstStride[0], ColorConverter::matrix(m_colorspace),
+			ColorConverter::isFullRange(entry.srcFormat, m_range));
+		return srcSliceH;
+	}
+	if (entry.nbSlices > 1 && srcSliceY == 0 && srcSliceH == entry.srcHeight) {
+		return scaleSlices(entry, data, srcStride, dst, dstStride);
+	}
+	if (entry.nbSlices > 1) {
+		// the bands can't take a part of the picture
+		return 0;
+	}
+	return sws_scale(entry.slices[0].get(), data, srcStride, srcSliceY, srcSliceH, dst, dstStride);
 }
 
 bool SwScaleContext::applyCachedContext(int srcWidth, int srcHeight, AVPixelFormat srcFormat, int dstWidth, int dstHeight, AVPixelFormat dstFormat, int flags, SwsFilter * srcFilter, SwsFilter * dstFilter, const double * param)
 {
-	SwsContext *retContext = sws_getCachedContext(m_context.get(), srcWidth, srcHeight, srcFormat, dstWidth, dstHeight, dstFormat, flags, srcFilter, dstFilter, param);
-	if (!retContext) {
-		return false;
+	for (auto it = m_cache.begin(); it != m_cache.end(); ++it) {
+		if (it->srcWidth == srcWidth && it->srcHeight == srcHeight && it->srcFormat == srcFormat &&
+			it->dstWidth == dstWidth && it->dstHeight == dstHeight && it->dstFormat == dstFormat &&
+			it->flags == flags) {
+			m_cache.splice(m_cache.begin(), m_cache, it);
+			return true;
+		}
+	}
+
+	bool native = srcWidth == dstWidth && srcHeight == dstHeight && ColorConverter::canConvert(srcFormat, dstFormat);
+	Entry entry;
+	entry.srcWidth = srcWidth;
+	entry.srcHeight = srcHeight;
+	entry.srcFormat = srcFormat;
+	entry.dstWidth = dstWidth;
+	entry.dstHeight = dstHeight;
+	entry.dstFormat = dstFormat;
+	entry.flags = flags;
+	entry.native = native;
+	entry.sliceHeight = srcHeight;
+	int count = nbSlices(srcWidth, srcHeight, srcFormat, dstWidth, dstHeight, dstFormat);
+	if (count > 1) {
+		entry.sliceHeight = FFALIGN((srcHeight + count - 1) / count, SLICE_ALIGN);
+		count = (srcHeight + entry.sliceHeight - 1) / entry.sliceHeight;
+	}
+	entry.nbSlices = count;
+	for (int i = 0; i < count && !native; i++) {
+		// each band is a picture of its own, which needs no scaling
+		int h = FFMIN(entry.sliceHeight, srcHeight - i * entry.sliceHeight);
+		SwsContext *context = sws_getContext(srcWidth, count > 1 ? h : srcHeight, srcFormat,
+			dstWidth, count > 1 ? h : dstHeight, dstFormat, flags, srcFilter, dstFilter, param);
+		if (!context) {
+			return false;
+		}
+		entry.slices.emplace_back(context);
+	}
+
+	m_cache.push_front(std::move(entry));
+	if (m_cache.size() > CACHE_SIZE) {
+		m_cache.pop_back();
+	}
+	return true;
+}
+
+void SwScaleContext::setColorDetails(AVColorSpace colorspace, AVColorRange range)
+{
+	m_colorspace = colorspace;
+	m_range = range;
+}
+
+// only same size conversions are cut, bands of a scaled picture would need
+// the rows around them. so would vertically subsampled chroma, which sws
+// interpolates across rows: each band would clamp it at its edges, leaving
+// seams. palettes and bitstreams can't be offset by rows either. the
+// kernels take none of these limits, they repeat the chroma of a row pair
+int SwScaleContext::nbSlices(int srcWidth, int srcHeight, AVPixelFormat srcFormat, int dstWidth, int dstHeight, AVPixelFormat dstFormat) const
+{
+	const uint64_t unsliceable = AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_PSEUDOPAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL;
+	const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get(srcFormat);
+	const AVPixFmtDescriptor *dstDesc = av_pix_fmt_desc_get(dstFormat);
+
+	if (m_maxSlices < 2 || srcWidth != dstWidth || srcHeight != dstHeight || !srcDesc || !dstDesc) {
+		return 1;
 	}
+	if (!ColorConverter::canConvert(srcFormat, dstFormat) && ((srcDesc->flags & unsliceable) || (dstDesc->flags & unsliceable) ||
+		srcDesc->log2_chroma_h > 0 || dstDesc->log2_chroma_h > 0)) {
+		return 1;
+	}
+	return av_clip(srcHeight / MIN_SLICE_HEIGHT, 1, m_maxSlices);
+}
 
-	if (retContext != m_context.get()) {
-		m_context.reset(retContext);
+// the rows of a plane that span rows rows of the picture
+static int planeRows(const AVPixFmtDescriptor *desc, int plane, int rows)
+{
+	if ((plane == 1 || plane == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB)) {
+		return rows >> desc->log2_chroma_h;
 	}
-	
-	return true;	
+	return rows;
+}
+
+int SwScaleContext::scaleSlices(const Entry & entry, const uint8_t * const * data, const int * srcStride, uint8_t * const * dst, const int * dstStride)
+{
+	const AVPixFmtDescriptor *srcDesc = av_pix_fmt_desc_get(entry.srcFormat);
+	const AVPixFmtDescriptor *dstDesc = av_pix_fmt_desc_get(entry.dstFormat);
+	int count = entry.nbSlices;
+	std::unique_ptr<int[]> heights(new int[count]);
+
+	TaskPool::instance().parallelFor(count, [&](int i) {
+		int y = i * entry.sliceHeight;
+		const uint8_t *src[4] = { nullptr, };
+		uint8_t *out[4] = { nullptr, };
+
+		for (int plane = 0; plane < 4; plane++) {
+			if (data[plane]) {
+				src[plane] = data[plane] + srcStride[plane] * planeRows(srcDesc, plane, y);
+			}
+			if (dst[plane]) {
+				out[plane] = dst[plane] + dstStride[plane] * planeRows(dstDesc, plane, y);
+			}
+		}
+		heights[i] = sws_scale(entry.slices[i].get(), src, srcStride, 0,
+			FFMIN(entry.sliceHeight, entry.srcHeight - y), out, dstStride);
+	});
+
+	int height = 0;
+	for (int i = 0; i < count; i++) {
+		if (heights[i] <= 0) {
+			// a band left out leaves the picture unusable
+			return 0;
+		}
+		height += heights[i];
+	}
+	return height;
+}
+
+int SwScaleContext::convertSlices(const Entry & entry, const uint8_t * const * data, const int * srcStride, uint8_t * dst, int dstStride)
+{
+	ColorConverter::Matrix matrix = ColorConverter::matrix(m_colorspace);
+	bool fullRange = ColorConverter::isFullRange(entry.srcFormat, m_range);
+
+	TaskPool::instance().parallelFor(entry.nbSlices, [&](int i) {
+		int y = i * entry.sliceHeight;
+		ColorConverter::convert(entry.srcFormat, data, srcStride, entry.srcWidth, y,
+			FFMIN(entry.sliceHeight, entry.srcHeight - y), dst, dstStride, matrix, fullRange);
+	});
+	return entry.srcHeight;
 }
@@ -1,24 +1,43 @@
 #pragma once
 
+#include <list>
 #include <memory>
+#include <vector>
 extern "C" {
 #include <libavutil/pixfmt.h>
 #include <libswscale/swscale.h>
 }
 struct SwsContext;
 struct SwsFilter;
+
+// keeps the contexts of the last few conversions, so that switching between
+// formats or sizes doesn't rebuild them. a conversion that doesn't scale is
+// cut into horizontal bands converted in parallel on the task pool, each
+// band by its own context straight into the destination. the conversions
+// ColorConverter has kernels for don't go through libswscale at all.
 class SwScaleContext
 {
 public:
-	SwScaleContext();
-	explicit SwScaleContext(SwsContext *context);
+	explicit SwScaleContext(int maxSlices = 1);
 	~SwScaleContext();
 
 public:
+	enum {
+		CACHE_SIZE = 4,
+		MIN_SLICE_HEIGHT = 64,
+		SLICE_ALIGN = 16	// keeps the bands on whole chroma rows
+	};
+
+public:
+	// colours of the pictures to come, only the ColorConverter kernels take
+	// them, libswscale keeps its bt.601 defaults
+	void setColorDetails(AVColorSpace colorspace, AVColorRange range);
 	int scale(const uint8_t * const *data, const int *srcStride,
 		int srcSliceY, int srcSliceH, uint8_t * const *dst, const int *dstStride);
+	// the filters and param aren't part of the cache key, they only apply to
+	// contexts created by this call
 	bool applyCachedContext(int srcWidth, int srcHeight, AVPixelFormat srcFormat,
-		int dstWidth, int dstHeight, AVPixelFormat dstFormat, int flags, SwsFilter *srcFilter = nullptr, 
+		int dstWidth, int dstHeight, AVPixelFormat dstFormat, int flags, SwsFilter *srcFilter = nullptr,
 		SwsFilter *dstFilter = nullptr, const double *param = nullptr);
 
 private:
@@ -29,9 +48,34 @@ private:
 			sws_freeContext(c);
 		}
 	};
-	
+
+	struct Entry
+	{
+		int srcWidth;
+		int srcHeight;
+		AVPixelFormat srcFormat;
+		int dstWidth;
+		int dstHeight;
+		AVPixelFormat dstFormat;
+		int flags;
+		bool native;		// converted by ColorConverter, no contexts
+		int nbSlices;
+		int sliceHeight;	// the whole height when not sliced
+		std::vector<std::unique_ptr<SwsContext, SwsDestroyer>> slices;
+	};
+
 private:
-	std::unique_ptr<SwsContext, SwsDestroyer> m_context = nullptr;
-	bool m_hasContext;
-};
+	int nbSlices(int srcWidth, int srcHeight, AVPixelFormat srcFormat,
+		int dstWidth, int dstHeight, AVPixelFormat dstFormat) const;
+	int scaleSlices(const Entry &entry, const uint8_t * const *data, const int *srcStride,
+		uint8_t * const *dst, const int *dstStride);
+	int convertSlices(const Entry &entry, const uint8_t * const *data, const int *srcStride,
+		uint8_t *dst, int dstStride);
 
+private:
+	int m_maxSlices;
+	AVColorSpace m_colorspace = AVCOL_SPC_UNSPECIFIED;
+	AVColorRange m_range = AVCOL_RANGE_UNSPECIFIED;
+	// most recently used first
+	std::list<Entry> m_cache;
+};
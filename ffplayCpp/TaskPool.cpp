@@ -0,0 +1,207 @@
+#include "TaskPool.h"
+#include <SDL.h>
+#include "Mutex.h"
+#include "Condition.h"
+#include "Thread.h"
+
+// the queue of the calling thread, workers only
+static thread_local int s_workerIndex = -1;
+
+TaskGroup::TaskGroup(TaskPool & pool) :
+	m_pool(pool),
+	m_mutex(std::make_unique<Mutex>()),
+	m_cond(std::make_unique<Condition>())
+{
+}
+
+
+TaskGroup::~TaskGroup()
+{
+	wait();
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+	m_pending++;
+	m_pool.submit({ std::move(task), this });
+
+	// a waiter sleeping on running tasks can help with this one
+	m_mutex->lock();
+	if (m_waiting) {
+		m_cond->signal();
+	}
+	m_mutex->unlock();
+}
+
+void TaskGroup::wait()
+{
+	for (;;) {
+		while (m_pending.load() && m_pool.runOne(s_workerIndex, this)) {
+		}
+
+		// checked under the lock even when done, so that the last finish()
+		// has let go of the group before it can be destroyed
+		m_mutex->lock();
+		if (!m_pending.load()) {
+			m_mutex->unlock();
+			return;
+		}
+		// nothing left to take, the remaining tasks are running
+		m_waiting = true;
+		m_cond->wait(*m_mutex);
+		m_waiting = false;
+		m_mutex->unlock();
+	}
+}
+
+void TaskGroup::finish()
+{
+	m_mutex->lock();
+	if (--m_pending == 0) {
+		m_cond->signal();
+	}
+	m_mutex->unlock();
+}
+
+// never destroyed, the workers go away with the process
+TaskPool & TaskPool::instance()
+{
+	static TaskPool *pool = new TaskPool(SDL_max(SDL_GetCPUCount() - 1, 1));
+	return *pool;
+}
+
+TaskPool::TaskPool(int nbWorkers) :
+	m_nbWorkers(nbWorkers),
+	m_queues(new WorkQueue[nbWorkers]),
+	m_mutex(std::make_unique<Mutex>()),
+	m_cond(std::make_unique<Condition>()),
+	m_workers(new std::unique_ptr<Thread>[nbWorkers])
+{
+	for (int i = 0; i < m_nbWorkers; i++) {
+		m_queues[i].mutex = std::make_unique<Mutex>();
+	}
+	for (int i = 0; i < m_nbWorkers; i++) {
+		m_workers[i] = std::make_unique<Thread>(workerThread, "taskWorker", this);
+	}
+}
+
+
+TaskPool::~TaskPool()
+{
+}
+
+void TaskPool::parallelFor(int count, const std::function<void(int)>& func)
+{
+	TaskGroup group(*this);
+
+	// the caller takes the last one itself
+	for (int i = 0; i < count - 1; i++) {
+		group.run([&func, i] { func(i); });
+	}
+	if (count > 0) {
+		func(count - 1);
+	}
+	group.wait();
+}
+
+void TaskPool::submit(Task && task)
+{
+	int index = s_workerIndex;
+	if (index < 0) {
+		// spread the tasks of outside threads, the workers steal the rest
+		index = m_nextQueue++ % m_nbWorkers;
+	}
+
+	// counted first so that it never drops below the tasks really queued,
+	// seq_cst, pairs with the check of the sleeping workers
+	m_nbQueued++;
+	WorkQueue &queue = m_queues[index];
+	queue.mutex->lock();
+	queue.tasks.push_back(std::move(task));
+	queue.mutex->unlock();
+
+	m_mutex->lock();
+	if (m_nbSleeping) {
+		m_cond->signal();
+	}
+	m_mutex->unlock();
+}
+
+// own queue from the back, the others from the front. given a group, only
+// its tasks, the oldest first
+bool TaskPool::take(int self, Task & task, const TaskGroup *group)
+{
+	for (int i = 0; i < m_nbWorkers; i++) {
+		int index = self >= 0 ? (self + i) % m_nbWorkers : i;
+		WorkQueue &queue = m_queues[index];
+		bool own = i == 0 && self >= 0;
+
+		queue.mutex->lock();
+		if (group) {
+			for (auto it = queue.tasks.begin(); it != queue.tasks.end(); ++it) {
+				if (it->group == group) {
+					task = std::move(*it);
+					queue.tasks.erase(it);
+					queue.mutex->unlock();
+					m_nbQueued--;
+					return true;
+				}
+			}
+		}
+		else if (!queue.tasks.empty()) {
+			if (own) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			}
+			else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			queue.mutex->unlock();
+			m_nbQueued--;
+			return true;
+		}
+		queue.mutex->unlock();
+	}
+	return false;
+}
+
+bool TaskPool::runOne(int self, const TaskGroup *group)
+{
+	Task task;
+
+	if (!m_nbQueued.load() || !take(self, task, group)) {
+		return false;
+	}
+	task.func();
+	task.group->finish();
+	return true;
+}
+
+void TaskPool::runWorker(int index)
+{
+	s_workerIndex = index;
+
+	for (;;) {
+		if (runOne(index)) {
+			continue;
+		}
+
+		m_mutex->lock();
+		m_nbSleeping++;
+		while (!m_nbQueued.load()) {
+			m_cond->wait(*m_mutex);
+		}
+		m_nbSleeping--;
+		m_mutex->unlock();
+	}
+}
+
+int TaskPool::workerThread(void * arg)
+{
+	TaskPool *pool = static_cast<TaskPool *>(arg);
+	static std::atomic<int> nextIndex{ 0 };
+
+	pool->runWorker(nextIndex++);
+	return 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+
+class Mutex;
+class Condition;
+class Thread;
+class TaskPool;
+
+// tasks that are waited for together. wait() runs the queued tasks of the
+// group itself instead of just sleeping, so a group doesn't wait for a busy
+// pool, and never those of other groups, which can take long.
+class TaskGroup
+{
+public:
+	explicit TaskGroup(TaskPool &pool);
+	~TaskGroup();
+
+public:
+	void run(std::function<void()> task);
+	void wait();
+
+private:
+	void finish();
+	friend class TaskPool;
+
+private:
+	TaskPool &m_pool;
+	std::atomic<int> m_pending{ 0 };
+	// the last finish() signals under it, so that the group outlives it
+	std::unique_ptr<Mutex> m_mutex;
+	std::unique_ptr<Condition> m_cond;
+	bool m_waiting = false;
+};
+
+// process wide worker threads for the data parallel work of the pipeline
+// threads (colour conversion slices, spectrum channels). every worker owns
+// a queue: it takes its own tasks from the back and steals from the front
+// of the others when it runs dry. tasks must not block on each other.
+class TaskPool
+{
+public:
+	static TaskPool &instance();
+
+public:
+	int nbWorkers() const { return m_nbWorkers; }
+
+	// runs func(i) for i in [0, count) and returns when all are done
+	void parallelFor(int count, const std::function<void(int)> &func);
+
+private:
+	struct Task
+	{
+		std::function<void()> func;
+		TaskGroup *group;
+	};
+
+	struct WorkQueue
+	{
+		std::unique_ptr<Mutex> mutex;
+		std::deque<Task> tasks;
+	};
+
+private:
+	explicit TaskPool(int nbWorkers);
+	~TaskPool();
+
+	void submit(Task &&task);
+	bool runOne(int self, const TaskGroup *group = nullptr);
+	bool take(int self, Task &task, const TaskGroup *group);
+	void runWorker(int index);
+	static int workerThread(void *arg);
+	friend class TaskGroup;
+
+private:
+	int m_nbWorkers;
+	// one per worker, threads outside the pool fill them in turn
+	std::unique_ptr<WorkQueue[]> m_queues;
+	std::atomic<int> m_nbQueued{ 0 };
+	std::atomic<unsigned int> m_nextQueue{ 0 };
+	std::unique_ptr<Mutex> m_mutex;
+	std::unique_ptr<Condition> m_cond;
+	int m_nbSleeping = 0;
+	std::unique_ptr<std::unique_ptr<Thread>[]> m_workers;
+};
@@ -1,8 +1,48 @@
 #include "Thread.h"
+#include "ThreadStats.h"
+#include <atomic>
+#include <string>
+extern "C" {
+#include <libavutil/log.h>
+}
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static SDL_Thread *createThread(SDL_ThreadFunction func, const char *threadName, void *arg, size_t stackSize)
+{
+	if (!stackSize) {
+		return SDL_CreateThread(func, threadName, arg);
+	}
 
+	// SDL only takes the stack size from a hint, which is read at creation
+	const char *hint = SDL_GetHint(SDL_HINT_THREAD_STACK_SIZE);
+	std::string previous = hint ? hint : "";
+	SDL_SetHint(SDL_HINT_THREAD_STACK_SIZE, std::to_string(stackSize).c_str());
+	SDL_Thread *thread = SDL_CreateThread(func, threadName, arg);
+	SDL_SetHint(SDL_HINT_THREAD_STACK_SIZE, hint ? previous.c_str() : nullptr);
+	return thread;
+}
+
+// every thread fails alike without the privileges, once each is enough
+static std::atomic<bool> s_maskFailureLogged{ false };
+static std::atomic<bool> s_priorityFailureLogged{ false };
+static std::atomic<bool> s_niceFailureLogged{ false };
 
-Thread::Thread(SDL_ThreadFunction func, const char *threadName, void *arg) :
-	m_thread(SDL_CreateThread(func, threadName, arg))
+Thread::Thread(SDL_ThreadFunction func, const char *threadName, void *arg, ThreadStats *stats,
+	const ThreadPolicy &policy) :
+	m_func(func),
+	m_arg(arg),
+	m_stats(stats),
+	m_name(threadName),
+	m_policy(policy),
+	m_thread(createThread(entry, threadName, this, policy.stackSize))
 {
 }
 
@@ -10,3 +50,118 @@ Thread::Thread(SDL_ThreadFunction func, const char *threadName, void *arg) :
 Thread::~Thread()
 {
 }
+
+int Thread::entry(void * arg)
+{
+	Thread *thread = static_cast<Thread *>(arg);
+	int ret;
+
+	applyPolicy(thread->m_name, thread->m_policy);
+	if (thread->m_stats) {
+		thread->m_stats->begin();
+	}
+	ret = thread->m_func(thread->m_arg);
+	if (thread->m_stats) {
+		thread->m_stats->update();
+	}
+	return ret;
+}
+
+void Thread::applyPolicy(const char * threadName, const ThreadPolicy & policy)
+{
+	// masks, realtime and raised priorities are only set when the user asks
+	// for them, unlike the lowered priority of the read thread
+	if (policy.cpuMask && !setAffinity(policy.cpuMask) && !s_maskFailureLogged.exchange(true)) {
+		av_log(nullptr, AV_LOG_WARNING, "%s: could not set cpu mask 0x%llx\n",
+			threadName, (unsigned long long)policy.cpuMask);
+	}
+	bool raised = policy.realtime || policy.nice < 0;
+	if ((policy.nice || policy.realtime) && !setPriority(policy) &&
+		!(raised ? s_priorityFailureLogged : s_niceFailureLogged).exchange(true)) {
+		av_log(nullptr, raised ? AV_LOG_WARNING : AV_LOG_VERBOSE, "%s: could not set priority (%snice %d)\n",
+			threadName, policy.realtime ? "realtime or " : "", policy.nice);
+	}
+	logPolicy(threadName);
+}
+
+bool Thread::setAffinity(uint64_t cpuMask)
+{
+#ifdef _WIN32
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)cpuMask) != 0;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int i = 0; i < 64 && i < CPU_SETSIZE; i++) {
+		if (cpuMask & (1ULL << i)) {
+			CPU_SET(i, &set);
+		}
+	}
+	return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	return false;
+#endif
+}
+
+bool Thread::setPriority(const ThreadPolicy & policy)
+{
+#ifdef _WIN32
+	int priority;
+	if (policy.realtime && SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+		return true;
+	}
+	if (policy.nice <= -10) {
+		priority = THREAD_PRIORITY_HIGHEST;
+	}
+	else if (policy.nice < 0) {
+		priority = THREAD_PRIORITY_ABOVE_NORMAL;
+	}
+	else if (policy.nice == 0) {
+		priority = THREAD_PRIORITY_NORMAL;
+	}
+	else if (policy.nice < 10) {
+		priority = THREAD_PRIORITY_BELOW_NORMAL;
+	}
+	else {
+		priority = THREAD_PRIORITY_LOWEST;
+	}
+	return SetThreadPriority(GetCurrentThread(), priority) != 0;
+#elif defined(__linux__)
+	if (policy.realtime) {
+		struct sched_param param;
+		param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		if (!pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+			return true;
+		}
+	}
+	// on linux the nice value belongs to the thread, not the process
+	return !setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), policy.nice);
+#else
+	return false;
+#endif
+}
+
+void Thread::logPolicy(const char * threadName)
+{
+#ifdef _WIN32
+	av_log(nullptr, AV_LOG_VERBOSE, "%s: priority %d\n", threadName, GetThreadPriority(GetCurrentThread()));
+#elif defined(__linux__)
+	cpu_set_t set;
+	std::string cpus;
+	if (!pthread_getaffinity_np(pthread_self(), sizeof(set), &set)) {
+		for (int i = 0; i < CPU_SETSIZE; i++) {
+			if (CPU_ISSET(i, &set)) {
+				cpus += (cpus.empty() ? "" : ",") + std::to_string(i);
+			}
+		}
+	}
+
+	int schedPolicy = SCHED_OTHER;
+	struct sched_param param = { 0 };
+	pthread_getschedparam(pthread_self(), &schedPolicy, &param);
+	av_log(nullptr, AV_LOG_VERBOSE, "%s: cpus %s, %s, nice %d\n", threadName, cpus.c_str(),
+		schedPolicy == SCHED_FIFO ? "SCHED_FIFO" : (schedPolicy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER"),
+		getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid)));
+#else
+	av_log(nullptr, AV_LOG_VERBOSE, "%s: default scheduling\n", threadName);
+#endif
+}
@@ -1,14 +1,43 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <SDL.h>
 
+class ThreadStats;
+
+// how the system schedules one pipeline thread. the thread applies it itself
+// when it starts and logs what it got at verbose level, whatever the system
+// refuses (raising the priority usually needs privileges) is skipped.
+struct ThreadPolicy
+{
+	// -20 (highest) to 19 (lowest) as on unix, windows maps it to a priority step
+	int nice = 0;
+	// SCHED_FIFO, or THREAD_PRIORITY_TIME_CRITICAL on windows. falls back to nice
+	bool realtime = false;
+	// bit n allows cpu n, 0 keeps the mask of the process
+	uint64_t cpuMask = 0;
+	// 0 keeps the default of SDL
+	size_t stackSize = 0;
+};
+
 class Thread
 {
 public:
-	Thread(SDL_ThreadFunction func, const char *threadName, void *arg);
+	Thread(SDL_ThreadFunction func, const char *threadName, void *arg, ThreadStats *stats = nullptr,
+		const ThreadPolicy &policy = ThreadPolicy());
 	~Thread();
 
+public:
+	// for threads created by someone else, like the audio callback of SDL
+	static void applyPolicy(const char *threadName, const ThreadPolicy &policy);
+
+private:
+	static int entry(void *arg);
+	static bool setAffinity(uint64_t cpuMask);
+	static bool setPriority(const ThreadPolicy &policy);
+	static void logPolicy(const char *threadName);
+
 private:
 	struct SDLThreadDestroyer
 	{
@@ -19,6 +48,10 @@ private:
 	};
 
 private:
+	SDL_ThreadFunction m_func;
+	void *m_arg;
+	ThreadStats *m_stats;
+	const char *m_name;
+	ThreadPolicy m_policy;
 	std::unique_ptr<SDL_Thread, SDLThreadDestroyer> m_thread;	
 };
-
@@ -0,0 +1,113 @@
+#include "ThreadStats.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <sys/resource.h>
+#endif
+extern "C" {
+#include <libavutil/time.h>
+}
+
+static thread_local ThreadStats *s_current = nullptr;
+
+static bool contextSwitches(int64_t &voluntary, int64_t &involuntary)
+{
+#ifdef RUSAGE_THREAD
+	struct rusage usage;
+	if (!getrusage(RUSAGE_THREAD, &usage)) {
+		voluntary = usage.ru_nvcsw;
+		involuntary = usage.ru_nivcsw;
+		return true;
+	}
+#endif
+	return false;
+}
+
+ThreadStats::ThreadStats()
+{
+}
+
+
+ThreadStats::~ThreadStats()
+{
+}
+
+void ThreadStats::begin()
+{
+	s_current = this;
+	m_wallStart = av_gettime_relative();
+	m_cpuStart = currentCpuTime();
+	m_nextSample = m_wallStart + SAMPLE_INTERVAL;
+	m_wallTime = 0.0;
+	m_cpuTime = 0.0;
+	m_wakeups = 0;
+	if (contextSwitches(m_voluntaryStart, m_involuntaryStart)) {
+		m_voluntarySwitches = 0;
+		m_involuntarySwitches = 0;
+	}
+}
+
+void ThreadStats::update()
+{
+	int64_t now = av_gettime_relative();
+	int64_t voluntary, involuntary;
+
+	m_nextSample = now + SAMPLE_INTERVAL;
+	m_wallTime = (now - m_wallStart) / 1000000.0;
+	m_cpuTime = currentCpuTime() - m_cpuStart;
+	if (contextSwitches(voluntary, involuntary)) {
+		m_voluntarySwitches = voluntary - m_voluntaryStart;
+		m_involuntarySwitches = involuntary - m_involuntaryStart;
+	}
+}
+
+// cheap enough for every frame or packet
+void ThreadStats::tick()
+{
+	if (av_gettime_relative() >= m_nextSample) {
+		update();
+	}
+}
+
+void ThreadStats::wakeUp()
+{
+	m_wakeups.store(m_wakeups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	tick();
+}
+
+void ThreadStats::countWakeup()
+{
+	if (s_current) {
+		s_current->wakeUp();
+	}
+}
+
+double ThreadStats::cpuLoad() const
+{
+	double wallTime = m_wallTime;
+	return wallTime > 0.0 ? 100.0 * m_cpuTime / wallTime : 0.0;
+}
+
+double ThreadStats::currentCpuTime()
+{
+#ifdef _WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime)) {
+		return 0.0;
+	}
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = kernelTime.dwLowDateTime;
+	kernel.HighPart = kernelTime.dwHighDateTime;
+	user.LowPart = userTime.dwLowDateTime;
+	user.HighPart = userTime.dwHighDateTime;
+	// 100 ns units
+	return (kernel.QuadPart + user.QuadPart) / 10000000.0;
+#else
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+		return 0.0;
+	}
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// wall clock, cpu time, context switches and wakeups of one pipeline thread.
+// the thread samples itself when it wakes up or ticks, at most every
+// SAMPLE_INTERVAL, any thread can read the last sample.
+class ThreadStats
+{
+public:
+	ThreadStats();
+	~ThreadStats();
+
+public:
+	enum {
+		SAMPLE_INTERVAL = 100000	// us
+	};
+
+	// must be called from the measured thread
+	void begin();
+	void update();
+	void tick();
+	void wakeUp();
+
+	// counts a wakeup of the calling thread, if it is measured
+	static void countWakeup();
+
+	double wallTime() const { return m_wallTime; }
+	double cpuTime() const { return m_cpuTime; }
+	// percent of one cpu since begin()
+	double cpuLoad() const;
+	int64_t wakeups() const { return m_wakeups; }
+	// -1 where the system doesn't count them per thread
+	int64_t voluntarySwitches() const { return m_voluntarySwitches; }
+	int64_t involuntarySwitches() const { return m_involuntarySwitches; }
+
+	static double currentCpuTime();
+
+private:
+	// written by the measured thread only
+	int64_t m_wallStart = 0;
+	double m_cpuStart = 0.0;
+	int64_t m_nextSample = 0;
+	std::atomic<double> m_wallTime{ 0.0 };
+	std::atomic<double> m_cpuTime{ 0.0 };
+	std::atomic<int64_t> m_wakeups{ 0 };
+	std::atomic<int64_t> m_voluntarySwitches{ -1 };
+	std::atomic<int64_t> m_involuntarySwitches{ -1 };
+	int64_t m_voluntaryStart = 0;
+	int64_t m_involuntaryStart = 0;
+};
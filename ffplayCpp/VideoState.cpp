@@ -9,6 +9,7 @@ extern "C" {
 #include <libavutil/opt.h>
 #include <libavfilter/buffersink.h>
 #include <libavutil/time.h>
+#include <libavutil/imgutils.h>
 #include <libavfilter/buffersrc.h>
 #include <libavcodec/avfft.h>
 #include <libswscale/swscale.h>
@@ -20,13 +21,22 @@ extern "C" {
 #include "Renderer.h"
 #include "Window.h"
 #include "Thread.h"
-#include "Condition.h"
+#include "Notifier.h"
 #include "SwScaleContext.h"
+#include "ColorConverter.h"
+#include "FrameConverter.h"
 #include "Mutex.h"
 #include "SwResampleContext.h"
+#include "NullSink.h"
+#include "FramePool.h"
+#include "TaskPool.h"
 
-#define FF_QUIT_EVENT    (SDL_USEREVENT + 2)
-#define REFRESH_RATE	0.01
+// window system events only arrive when pumped, this bounds their latency
+#define EVENT_POLL_INTERVAL	0.05
+// timed waits wake up in whole milliseconds and a little late,
+// the end of a wait is slept precisely
+#define PRECISE_WAIT_MARGIN	0.002
+#define EVENT_RETRY_DELAY	0.001
 
 AVDictionary *VideoState::m_formatOpts;
 AVDictionary *VideoState::m_codecOpts;
@@ -38,6 +48,12 @@ static VideoState::ShowMode s_showMode = VideoState::SHOW_MODE_NONE;
 static int defaultWidth = 640;
 static int defaultHeight = 480;
 static int s_lowres = 0;
+// when no lowres is given, the video decoder takes the largest one that
+// still decodes at least at the displayed size
+static int s_autoLowres = 1;
+// pictures shown smaller than they are decoded are scaled down to the
+// displayed size on the decoder thread
+static int s_displayDownscale = 1;
 
 static const char *s_audioCodecName;
 static const char *s_videoCodecName;
@@ -45,6 +61,12 @@ static const char *s_subtitleCodecName;
 
 static int s_fast = 0;
 static int s_infiniteBuffer = -1;
+static int s_maxQueueSize = 15 * 1024 * 1024;
+// packets, decoded frames and scratch together, 0 disables
+static int64_t s_maxMemory = 512 * 1024 * 1024;
+static double s_minQueueDuration = 1.0;
+// per packet queue, with an infinite buffer payloads beyond it go to disk. 0 disables
+static int64_t s_spillThreshold = 64 * 1024 * 1024;
 
 static int s_loop = 1;
 static int s_autoexit = 0;
@@ -54,6 +76,32 @@ static int s_cursorHidden = 0;
 static int64_t s_cursorLastShown;
 #define CURSOR_HIDE_DELAY	1000000
 
+// scheduling of the pipeline threads. cpu masks pin them (bit n is cpu n,
+// 0 leaves them to the system), nice values go from -20 (first) to 19 (last).
+// raising a priority usually needs privileges, so it is left to the user
+static uint64_t s_readCpuMask = 0;
+static uint64_t s_decoderCpuMask = 0;
+static uint64_t s_audioCpuMask = 0;
+static int s_readNice = 5;
+static int s_videoNice = 0;
+static int s_audioNice = 0;
+static int s_audioRealtime = 0;
+
+// decoders run as resumable jobs on the task pool instead of one thread each,
+// for processes playing many streams. the read thread stays, demuxing blocks
+static int s_resumableDecoding = 0;
+// frames a resumable decoder produces before it lets the other jobs run
+#define RESUME_BATCH	8
+
+static ThreadPolicy threadPolicy(uint64_t cpuMask, int nice, bool realtime = false)
+{
+	ThreadPolicy policy;
+	policy.cpuMask = cpuMask;
+	policy.nice = nice;
+	policy.realtime = realtime;
+	return policy;
+}
+
 static int s_displayDisable;
 static double s_rdftSpeed = 0.02;
 
@@ -72,26 +120,112 @@ static unsigned s_swsFlags = SWS_BICUBIC;
 
 const float VideoState::AV_NOSYNC_THRESHOLD = 10.0;
 
-VideoState::VideoState(const char * filename, AVInputFormat * iformat) :
+// pixel formats a texture takes as they are, the others are converted to BGRA
+static const struct TextureFormatEntry {
+	AVPixelFormat format;
+	Uint32 textureFormat;
+} s_textureFormats[] = {
+	{ AV_PIX_FMT_RGB8, SDL_PIXELFORMAT_RGB332 },
+	{ AV_PIX_FMT_RGB444, SDL_PIXELFORMAT_RGB444 },
+	{ AV_PIX_FMT_RGB555, SDL_PIXELFORMAT_RGB555 },
+	{ AV_PIX_FMT_BGR555, SDL_PIXELFORMAT_BGR555 },
+	{ AV_PIX_FMT_RGB565, SDL_PIXELFORMAT_RGB565 },
+	{ AV_PIX_FMT_BGR565, SDL_PIXELFORMAT_BGR565 },
+	{ AV_PIX_FMT_RGB24, SDL_PIXELFORMAT_RGB24 },
+	{ AV_PIX_FMT_BGR24, SDL_PIXELFORMAT_BGR24 },
+	{ AV_PIX_FMT_0RGB32, SDL_PIXELFORMAT_RGB888 },
+	{ AV_PIX_FMT_0BGR32, SDL_PIXELFORMAT_BGR888 },
+	{ AV_PIX_FMT_NE(RGB0, 0BGR), SDL_PIXELFORMAT_RGBX8888 },
+	{ AV_PIX_FMT_NE(BGR0, 0RGB), SDL_PIXELFORMAT_BGRX8888 },
+	{ AV_PIX_FMT_RGB32, SDL_PIXELFORMAT_ARGB8888 },
+	{ AV_PIX_FMT_RGB32_1, SDL_PIXELFORMAT_RGBA8888 },
+	{ AV_PIX_FMT_BGR32, SDL_PIXELFORMAT_ABGR8888 },
+	{ AV_PIX_FMT_BGR32_1, SDL_PIXELFORMAT_BGRA8888 },
+	{ AV_PIX_FMT_YUV420P, SDL_PIXELFORMAT_IYUV },
+	{ AV_PIX_FMT_NV12, SDL_PIXELFORMAT_NV12 },
+	{ AV_PIX_FMT_NV21, SDL_PIXELFORMAT_NV21 },
+	{ AV_PIX_FMT_YUYV422, SDL_PIXELFORMAT_YUY2 },
+	{ AV_PIX_FMT_UYVY422, SDL_PIXELFORMAT_UYVY },
+	{ AV_PIX_FMT_YVYU422, SDL_PIXELFORMAT_YVYU },
+};
+
+static Uint32 textureFormat(int format)
+{
+	for (auto &entry : s_textureFormats) {
+		if (entry.format == format) {
+			return entry.textureFormat;
+		}
+	}
+	return SDL_PIXELFORMAT_UNKNOWN;
+}
+
+VideoState::VideoState(const char * filename, AVInputFormat * iformat, bool nullSink, int decoderPriority) :
 	m_filename(av_strdup(filename)),
+	m_decoderPriority(decoderPriority),
 	m_iFormat(iformat),
-	m_pictureQ(m_videoQ, FrameQueue::VIDEO_PICTURE_QUEUE_SIZE, 1),
-	m_subPictureQ(m_subtitleQ, FrameQueue::SUBPICTURE_QUEUE_SIZE, 0),
-	m_sampleQ(m_audioQ, FrameQueue::SAMPLE_QUEUE_SIZE, 1),
-	m_condReadThread(std::make_unique<Condition>()),
+	m_nullSink(nullSink),
+	m_videoQ(PacketQueue::TIMESHIFT_CAPACITY),
+	m_audioQ(PacketQueue::TIMESHIFT_CAPACITY),
+	m_pictureQ(m_videoQ, FrameQueue::VIDEO_PICTURE_QUEUE_MIN, FrameQueue::VIDEO_PICTURE_QUEUE_SIZE, FrameQueue::VIDEO_PICTURE_QUEUE_MAX, 1),
+	m_subPictureQ(m_subtitleQ, FrameQueue::SUBPICTURE_QUEUE_SIZE, FrameQueue::SUBPICTURE_QUEUE_SIZE, FrameQueue::SUBPICTURE_QUEUE_SIZE, 0),
+	m_sampleQ(m_audioQ, FrameQueue::SAMPLE_QUEUE_MIN, FrameQueue::SAMPLE_QUEUE_SIZE, FrameQueue::SAMPLE_QUEUE_MAX, 1),
+	m_memory(s_maxQueueSize, s_maxMemory),
+	m_continueReadThread(std::make_unique<Notifier>()),
+	m_packetsQueued(std::make_unique<Notifier>()),
+	m_refreshNotifier(std::make_unique<Notifier>()),
 	m_audClk(m_audioQ),
 	m_vidClk(m_videoQ),
 	m_extClk(m_subtitleQ),
-	m_readThread(std::make_unique<Thread>(readThread, "readThread", this)),
+	m_readStage("read", Stage::STAGE_SOURCE, m_readThreadStats),
+	m_audioOutStage("acb", Stage::STAGE_SINK, m_audioCallbackStats),
+	m_displayStage("ui", Stage::STAGE_SINK, m_renderStats),
 	m_subConvertCtx(std::make_unique<SwScaleContext>()),
-	m_imgConvertCtx(std::make_unique<SwScaleContext>()),
-	m_swResampleCtx(std::make_unique<SwResampleContext>())
+	m_frameConverter(std::make_unique<FrameConverter>("vconv", TaskPool::instance().nbWorkers() + 1,
+		[](AVPixelFormat format) { return textureFormat(format) != SDL_PIXELFORMAT_UNKNOWN; }, AV_PIX_FMT_BGRA, s_swsFlags)),
+	m_swResampleCtx(std::make_unique<SwResampleContext>()),
+	m_videoFramePool(std::make_unique<FramePool>(m_pictureQ))
 {
-	if (!m_condReadThread) {
+	if (!m_continueReadThread) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
 		// TODO : throw exception;
 	}
 
+	// the decoders and the renderer wake the read thread up when they consume
+	m_videoQ.setConsumerNotifier(m_continueReadThread.get());
+	m_audioQ.setConsumerNotifier(m_continueReadThread.get());
+	m_subtitleQ.setConsumerNotifier(m_continueReadThread.get());
+	m_pictureQ.setConsumerNotifier(m_continueReadThread.get());
+	m_subPictureQ.setConsumerNotifier(m_continueReadThread.get());
+	m_sampleQ.setConsumerNotifier(m_continueReadThread.get());
+	m_videoQ.setProducerNotifier(m_packetsQueued.get());
+	m_audioQ.setProducerNotifier(m_packetsQueued.get());
+	m_subtitleQ.setProducerNotifier(m_packetsQueued.get());
+	// and the video decoder wakes the refresh loop up when a picture arrives
+	m_pictureQ.setProducerNotifier(m_refreshNotifier.get());
+	SDL_AddEventWatch(eventWatch, this);
+
+	// the refresh loop runs on the thread creating this
+	m_renderStats.begin();
+
+	// decoders and sinks join as their streams open
+	m_readStage.setRunning();
+	m_pipeline.add(m_readStage);
+	if (!m_nullSink) {
+		m_displayStage.setRunning();
+		m_displayStage.setInput(m_pictureQ);
+		m_audioOutStage.setInput(m_sampleQ);
+		// the video decoder feeds it once it opens
+		m_pipeline.add(*m_frameConverter);
+		m_pipeline.add(m_displayStage, m_frameConverter.get());
+	}
+
+	m_memory.addStream(m_audioQ, m_sampleQ);
+	m_memory.addStream(m_videoQ, m_pictureQ);
+	m_memory.addStream(m_subtitleQ, m_subPictureQ, false);
+
+	// demuxing runs ahead of playback and can wait
+	m_readThread = std::make_unique<Thread>(readThread, "readThread", this, &m_readThreadStats,
+		threadPolicy(s_readCpuMask, s_readNice));
 	if (!m_readThread)	{
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateThread(): %s\n", SDL_GetError());
 		// TODO : throw exception;
@@ -100,6 +234,7 @@ VideoState::VideoState(const char * filename, AVInputFormat * iformat) :
 
 VideoState::~VideoState()
 {
+	SDL_DelEventWatch(eventWatch, this);
 }
 
 int VideoState::masterSyncType() const
@@ -216,28 +351,69 @@ void VideoState::toggleStreamPause()
 	m_audClk.setPaused(m_paused);
 	m_vidClk.setPaused(m_paused);
 	m_extClk.setPaused(m_paused);
+	m_continueReadThread->notify();
 }
 
 void VideoState::refreshLoopWaitEvent(SDL_Event & event)
 {
-	double remainingTime = 0.0;
+	if (m_nullSink) {
+		// nothing is presented, just wait for the read thread to finish
+		SDL_WaitEvent(&event);
+		return;
+	}
+
 	SDL_PumpEvents();
 	while (!SDL_PeepEvents(&event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT)) {
-		if (!s_cursorHidden && av_gettime_relative() - s_cursorLastShown > CURSOR_HIDE_DELAY) {
-			SDL_ShowCursor(0);
-			s_cursorHidden = 1;
+		int64_t now = av_gettime_relative();
+		m_renderStats.tick();
+		double remainingTime = EVENT_POLL_INTERVAL;
+		bool needPicture = false;
+
+		if (!s_cursorHidden) {
+			if (now - s_cursorLastShown > CURSOR_HIDE_DELAY) {
+				SDL_ShowCursor(0);
+				s_cursorHidden = 1;
+			}
+			else {
+				remainingTime = FFMIN(remainingTime, (s_cursorLastShown + CURSOR_HIDE_DELAY - now) / 1000000.0);
+			}
 		}
-		if (remainingTime > 0.0) {
-			av_usleep((int64_t)(remainingTime * 1000000.0));
+		if (m_eventPending.exchange(false)) {
+			// the watch sees an event just before it is queued
+			remainingTime = FFMIN(remainingTime, EVENT_RETRY_DELAY);
 		}
-		remainingTime = REFRESH_RATE;
 		if (m_showMode != SHOW_MODE_NONE && (!m_paused || m_forceRefresh)) {
 			refreshVideo(remainingTime);
+			needPicture = m_videoSt && !m_paused && m_pictureQ.remaining() == 0;
+		}
+		if (remainingTime > 0.0) {
+			waitForDeadline(av_gettime_relative() / 1000000.0 + remainingTime, needPicture);
 		}
 		SDL_PumpEvents();
 	}
 }
 
+// sleeps until the deadline, or until an event is pushed or, when the
+// display waits for one, a picture
+void VideoState::waitForDeadline(double deadline, bool needPicture)
+{
+	auto wakeUp = [&] {
+		return m_eventPending.load() || (needPicture && m_pictureQ.remaining() > 0);
+	};
+
+	double remaining = deadline - av_gettime_relative() / 1000000.0;
+	if (remaining > PRECISE_WAIT_MARGIN) {
+		if (m_refreshNotifier->waitTimeout(wakeUp, (Uint32)((remaining - PRECISE_WAIT_MARGIN) * 1000.0))) {
+			return;
+		}
+		remaining = deadline - av_gettime_relative() / 1000000.0;
+	}
+	if (remaining > 0.0 && !wakeUp()) {
+		av_usleep((unsigned int)(remaining * 1000000.0));
+		ThreadStats::countWakeup();
+	}
+}
+
 static int checkStreamSpecifier(AVFormatContext *s, AVStream *st, const char *spec)
 {
 	int ret = avformat_match_stream_specifier(s, st, spec);
@@ -310,6 +486,31 @@ static AVDictionary *filterCodecOpts(AVDictionary *opts, AVCodecID codecId, AVFo
 	return ret;
 }
 
+// pixels per second, what the decoding work mostly grows with
+static int64_t pixelRate(AVFormatContext *ic, AVStream *st, const AVCodecContext *avctx)
+{
+	AVRational frameRate = av_guess_frame_rate(ic, st, nullptr);
+	double fps = (frameRate.num && frameRate.den) ? av_q2d(frameRate) : 25.0;
+
+	return static_cast<int64_t>((int64_t)FFMAX(avctx->width, 1) * FFMAX(avctx->height, 1) * FFMIN(fps, 240.0));
+}
+
+// the largest lowres, up to maxLowres, that keeps a width x height picture
+// at least as large as the display
+static int displayLowres(int width, int height, int displayWidth, int displayHeight, int maxLowres)
+{
+	int lowres = 0;
+
+	if (displayWidth <= 0 || displayHeight <= 0) {
+		return 0;
+	}
+	while (lowres < maxLowres && AV_CEIL_RSHIFT(width, lowres + 1) >= displayWidth &&
+		AV_CEIL_RSHIFT(height, lowres + 1) >= displayHeight) {
+		lowres++;
+	}
+	return lowres;
+}
+
 int VideoState::openStreamComponent(int streamIndex)
 {
 	AVFormatContext *ic = m_ic;
@@ -322,6 +523,8 @@ int VideoState::openStreamComponent(int streamIndex)
 	int64_t channelLayout;
 	int ret = 0;
 	int streamLowres = s_lowres;
+	int schedulerId = -1;
+	AVDictionary *reopenOpts = nullptr;
 	
 	if (streamIndex < 0 || (unsigned int)streamIndex >= ic->nb_streams) {
 		return -1;
@@ -373,6 +576,12 @@ int VideoState::openStreamComponent(int streamIndex)
 	}
 
 	avctx->codec_id = codec->id;
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO && !s_lowres && s_autoLowres) {
+		// the size the previous stream was shown at, the decoder follows
+		// the window at the keyframes after that
+		streamLowres = displayLowres(avctx->width, avctx->height, m_displayWidth, m_displayHeight,
+			av_codec_get_max_lowres(codec));
+	}
 #if FF_API_LOWRES
 	/**
 	 * low resolution decoding, 1-> 1/2 size, 2->1/4 size
@@ -402,7 +611,14 @@ int VideoState::openStreamComponent(int streamIndex)
 
 	opts = filterCodecOpts(m_codecOpts, avctx->codec_id, ic, ic->streams[streamIndex], codec);
 	if (!av_dict_get(opts, "threads", nullptr, 0)) {
-		av_dict_set(&opts, "threads", "auto", 0);
+		// video decoders share the cores with those of the other instances
+		if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+			schedulerId = DecoderScheduler::instance().add(m_filename, m_decoderPriority, pixelRate(ic, ic->streams[streamIndex], avctx));
+			av_dict_set_int(&opts, "threads", DecoderScheduler::instance().threads(schedulerId), 0);
+		}
+		else {
+			av_dict_set(&opts, "threads", "auto", 0);
+		}
 	}
 	if (streamLowres) {
 		av_dict_set_int(&opts, "lowres", streamLowres, 0);
@@ -410,6 +626,13 @@ int VideoState::openStreamComponent(int streamIndex)
 	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO || avctx->codec_type == AVMEDIA_TYPE_AUDIO) {
 		av_dict_set(&opts, "refcounted_frames", "1", 0);
 	}
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		m_videoFramePool->attach(avctx);
+	}
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		av_dict_copy(&reopenOpts, opts, 0);
+		m_displayLowres = streamLowres;
+	}
 	if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
 		// TODO : handle error
 	}
@@ -444,48 +667,84 @@ int VideoState::openStreamComponent(int streamIndex)
 		nbChannels = avctx->channels;
 		channelLayout = avctx->channel_layout;
 #endif
-		if ((ret = openAudio(channelLayout, nbChannels, sampleRate, m_audioTgt)) < 0) {
-			// TODO : handle error
-		}
-		m_audioHwBufSize = ret;
-		m_audioSrc = m_audioTgt;
-		m_audioBufSize = 0;
-		m_audioBufIndex = 0;
+		if (!m_nullSink) {
+			if ((ret = openAudio(channelLayout, nbChannels, sampleRate, m_audioTgt)) < 0) {
+				// TODO : handle error
+			}
+			m_audioHwBufSize = ret;
+			m_audioSrc = m_audioTgt;
+			m_audioBufSize = 0;
+			m_audioBufIndex = 0;
 
-		m_audioDiffAvgCoef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
-		m_audioDiffAvgCount = 0;
-		m_audioDiffThreshold = (double)(m_audioHwBufSize / m_audioTgt.bytesPerSec);
+			m_audioDiffAvgCoef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+			m_audioDiffAvgCount = 0;
+			m_audioDiffThreshold = (double)(m_audioHwBufSize / m_audioTgt.bytesPerSec);
+		}
 
 		m_audioStream = streamIndex;
 		m_audioSt = ic->streams[streamIndex];
 
-		m_audDec.reset(new Decoder(avctx, m_audioQ, *m_condReadThread.get()));
+		m_audDec.reset(new Decoder("adec", avctx, m_audioQ, m_sampleQ, *m_continueReadThread.get()));
 		if ((m_ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK))
 			&& !m_ic->iformat->read_seek) {
 			m_audDec->setStartPts(m_audioSt->start_time);
 			m_audDec->setStartPtsTb(m_audioSt->time_base);
 		}
-		if ((ret = m_audDec->start(audioThread, this)) < 0) {
+		if (s_resumableDecoding) {
+			ret = m_audDec->startResumable([this] { return resumeAudioDecoding(); }, *m_packetsQueued, *m_continueReadThread);
+		}
+		else if ((ret = m_audDec->start(audioThread, this, "audioDecoder", threadPolicy(s_audioCpuMask, s_audioNice))) < 0) {
 			// TODO : throw exception
 		}
-		SDL_PauseAudio(0);
+		m_pipeline.add(*m_audDec, &m_readStage);
+		if (m_nullSink) {
+			m_audioSink = std::make_unique<NullSink>(m_sampleQ, "asink");
+			m_pipeline.add(*m_audioSink, m_audDec.get());
+		}
+		else {
+			m_pipeline.add(m_audioOutStage, m_audDec.get());
+			SDL_PauseAudio(0);
+		}
 		break;
 	case AVMEDIA_TYPE_VIDEO:
 		m_videoStream = streamIndex;
 		m_videoSt = ic->streams[streamIndex];
+		av_log(nullptr, AV_LOG_VERBOSE, "colour conversion kernels: %s\n", ColorConverter::implementation());
 
-		m_vidDec.reset(new Decoder(avctx, m_videoQ, *m_condReadThread.get()));
-		if ((ret = m_vidDec->start(videoThread, this)) < 0) {
+		m_vidDec.reset(new Decoder("vdec", avctx, m_videoQ, m_pictureQ, *m_continueReadThread.get()));
+		m_vidDec->setScheduled(schedulerId, reopenOpts, ic->streams[streamIndex]->codecpar);
+		schedulerId = -1;
+		reopenOpts = nullptr;
+		if (s_resumableDecoding) {
+			ret = m_vidDec->startResumable([this] { return resumeVideoDecoding(); }, *m_packetsQueued, *m_continueReadThread);
+		}
+		else if ((ret = m_vidDec->start(videoThread, this, "videoDecoder", threadPolicy(s_decoderCpuMask, s_videoNice))) < 0) {
 			// TODO : throw exception
 		}
+		m_pipeline.add(*m_vidDec, &m_readStage);
+		if (m_nullSink) {
+			m_videoSink = std::make_unique<NullSink>(m_pictureQ, "vsink");
+			m_pipeline.add(*m_videoSink, m_vidDec.get());
+		}
+		else {
+			m_pipeline.connect(*m_frameConverter, *m_vidDec);
+		}
 		break;
 	case AVMEDIA_TYPE_SUBTITLE:
 		m_subtitleStream = streamIndex;
 		m_subtitleSt = ic->streams[streamIndex];
-		m_subDec.reset(new Decoder(avctx, m_subtitleQ, *m_condReadThread.get()));
-		if ((ret = m_subDec->start(subTitleThread, this)) < 0) {
+		m_subDec.reset(new Decoder("sdec", avctx, m_subtitleQ, m_subPictureQ, *m_continueReadThread.get()));
+		if (s_resumableDecoding) {
+			ret = m_subDec->startResumable([this] { return resumeSubtitleDecoding(); }, *m_packetsQueued, *m_continueReadThread);
+		}
+		else if ((ret = m_subDec->start(subTitleThread, this, "subtitleDecoder", threadPolicy(s_decoderCpuMask, 0))) < 0) {
 			// TODO : throw exception
 		}
+		m_pipeline.add(*m_subDec, &m_readStage);
+		if (m_nullSink) {
+			m_subtitleSink = std::make_unique<NullSink>(m_subPictureQ, "ssink");
+			m_pipeline.add(*m_subtitleSink, m_subDec.get());
+		}
 		break;
 	default:
 		break;
@@ -496,6 +755,8 @@ fail:
 	avcodec_free_context(&avctx);
 
 out:
+	DecoderScheduler::instance().remove(schedulerId);
+	av_dict_free(&reopenOpts);
 	av_dict_free(&opts);
 
 	return ret;
@@ -672,6 +933,7 @@ int VideoState::audioDecodeFrame()
 			return -1;
 		}
 		m_sampleQ.next();
+		m_audioOutStage.count();
 	} while (!m_audioQ.isSameSerial(af->serial()));
 
 	dataSize = av_samples_get_buffer_size(nullptr, af->channels(), af->nbSamples(), af->frameFormat(), 1);
@@ -715,6 +977,7 @@ int VideoState::audioDecodeFrame()
 		if (!m_audioBuf1) {
 			return AVERROR(ENOMEM);
 		}
+		m_memory.setScratch(MemoryGovernor::SCRATCH_AUDIO_BUFFER, m_audioBuf1Size);
 		len2 = m_swResampleCtx->convert(out, outCount, in, af->frame()->nb_samples);
 		if (len2 < 0) {
 			av_log(nullptr, AV_LOG_ERROR, "swr_convert() failed\n");
@@ -763,7 +1026,7 @@ void VideoState::seekStream(int64_t pos, int64_t rel, int seekByBytes)
 			m_seekFlags |= AVSEEK_FLAG_BYTE;
 		}
 		m_seekReq = 1;
-		m_condReadThread->signal();
+		m_continueReadThread->notify();
 	}
 }
 
@@ -884,7 +1147,10 @@ retry:
 				}
 			}
 			m_pictureQ.next();
+			m_displayStage.count();
 			m_forceRefresh = 1;
+			// the deadline of the next picture is known on the next pass
+			remainingTime = 0.0;
 
 			if (m_step && !m_paused) {
 				toggleStreamPause();
@@ -901,6 +1167,7 @@ display:
 		int64_t curTime;
 		int aqSize, vqSize, sqSize;
 		double avDiff;
+		char cpu[128];
 
 		curTime = av_gettime_relative();
 		if (!lastTime || (curTime - lastTime) >= 30000) {
@@ -926,18 +1193,34 @@ display:
 			else if (m_audioSt) {
 				avDiff = getMasterClock() - m_audClk.getClock();
 			}
+
+			// cpu percent and wakeups per second of each stage
+			PipelineGraph::Node nodes[PipelineGraph::MAX_STAGES];
+			int nbNodes = m_pipeline.nodes(nodes);
+			cpu[0] = 0;
+			for (int i = 0; i < nbNodes; i++) {
+				const ThreadStats *stats = nodes[i].stage->threadStats();
+				if (stats) {
+					av_strlcatf(cpu, sizeof(cpu), " %s=%.0f%%/%.0f", nodes[i].stage->name(), stats->cpuLoad(),
+						stats->wallTime() > 0.0 ? stats->wakeups() / stats->wallTime() : 0.0);
+				}
+			}
 			
 			av_log(nullptr, AV_LOG_INFO,
-				"%7.2f %s:%7.3f fd=%4d aq=%5dKB vq=%5dB sq=%5dB f=%" PRId64 "/%" PRId64 "	\r",
+				"%7.2f %s:%7.3f fd=%4d gs=%3d cv=%5" PRId64 " aq=%5dKB vq=%5dKB sq=%5dB mem=%5dMB f=%" PRId64 "/%" PRId64 "%s	\r",
 				getMasterClock(),
 				(m_audioSt && m_videoSt) ? "A-V" : (m_videoSt ? "M-V" : (m_audioSt ? "M-A" : "   ")),
 				avDiff,
 				m_frameDropsEarly + m_frameDropsLate,
+				m_gopSkips,
+				m_frameConverter->nbConverted(),
 				aqSize / 1024,
 				vqSize / 1024,
 				sqSize,
-				m_videoSt ? m_vidDec->avctx()->pts_correction_num_faulty_dts : 0,
-				m_videoSt ? m_vidDec->avctx()->pts_correction_num_faulty_dts : 0);
+				static_cast<int>(m_memory.totalBytes() >> 20),
+				m_videoSt ? m_vidDec->nbFaultyDts() : 0,
+				m_videoSt ? m_vidDec->nbFaultyPts() : 0,
+				cpu);
 			fflush(stdout);
 			lastTime = curTime;
 		}
@@ -1010,12 +1293,12 @@ void VideoState::updateVideoPts(double pts, int64_t pos, int serial)
 	m_extClk.syncClock(m_vidClk);
 }
 
-int VideoState::getVideoFrame(AVFrame * frame)
+int VideoState::getVideoFrame(AVFrame * frame, int block)
 {
 	int gotPicture;
 
-	if ((gotPicture = m_vidDec->decodeFrame(frame, nullptr)) < 0) {
-		return -1;
+	if ((gotPicture = m_vidDec->decodeFrame(frame, nullptr, block)) < 0) {
+		return gotPicture == AVERROR(EAGAIN) ? gotPicture : -1;
 	}
 
 	if (gotPicture) {
@@ -1026,7 +1309,7 @@ int VideoState::getVideoFrame(AVFrame * frame)
 		}
 		frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(m_ic, m_videoSt, frame);
 
-		if (s_frameDrop > 0 || (s_frameDrop && masterSyncType() != AV_SYNC_VIDEO_MASTER)) {
+		if (!m_nullSink && (s_frameDrop > 0 || (s_frameDrop && masterSyncType() != AV_SYNC_VIDEO_MASTER))) {
 			if (frame->pts != AV_NOPTS_VALUE) {
 				double diff = dpts - getMasterClock();
 				if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
@@ -1036,6 +1319,19 @@ int VideoState::getVideoFrame(AVFrame * frame)
 					m_frameDropsEarly++;
 					av_frame_unref(frame);
 					gotPicture = 0;
+
+					// chronically behind, don't decode the rest of the GOP either
+					if (++m_lateFrames >= LATE_FRAMES_BEFORE_GOP_SKIP) {
+						int dropped = m_vidDec->skipToKeyframe();
+						if (dropped > 0) {
+							m_gopSkips++;
+							m_frameDropsEarly += dropped;
+							m_lateFrames = 0;
+						}
+					}
+				}
+				else {
+					m_lateFrames = 0;
 				}
 			}
 		}
@@ -1093,6 +1389,23 @@ int VideoState::queuePicture(AVFrame * srcFrame, double pts, double duration, in
 		av_get_picture_type_char(srcFrame->pict_type), pts);
 #endif
 
+	// the window fits the decoded picture, not the one scaled down
+	AVRational sar = srcFrame->sample_aspect_ratio;
+	int width = srcFrame->width;
+	int height = srcFrame->height;
+
+	// before waiting for room, the render thread only uploads. a picture
+	// that can't be converted is dropped, the next ones may still be
+	if (!m_nullSink) {
+		int ret = prepareForDisplay(srcFrame);
+		if (ret < 0) {
+			char errBuf[AV_ERROR_MAX_STRING_SIZE];
+			av_strerror(ret, errBuf, sizeof(errBuf));
+			av_log(nullptr, AV_LOG_ERROR, "dropping a picture that could not be converted: %s\n", errBuf);
+			return 0;
+		}
+	}
+
 	if (!(vp = m_pictureQ.peekWritable())) {
 		return -1;
 	}
@@ -1103,7 +1416,7 @@ int VideoState::queuePicture(AVFrame * srcFrame, double pts, double duration, in
 
 	vp->setPosInfo(pts, duration, serial, pos);
 
-	setDefaultWindowSize(vp->width(), vp->height(), vp->sar());
+	setDefaultWindowSize(width, height, sar);
 
 	av_frame_move_ref(vp->frame(), srcFrame);
 	m_pictureQ.push();
@@ -1111,6 +1424,28 @@ int VideoState::queuePicture(AVFrame * srcFrame, double pts, double duration, in
 	return 0;
 }
 
+// follows the displayed size with the lowres of the decoder, then hands the
+// picture to the converter stage
+int VideoState::prepareForDisplay(AVFrame *frame)
+{
+	int displayWidth = m_displayWidth;
+	int displayHeight = m_displayHeight;
+
+	if (!s_lowres && s_autoLowres) {
+		AVCodecParameters *codecpar = m_videoSt->codecpar;
+		int lowres = displayLowres(codecpar->width, codecpar->height, displayWidth, displayHeight,
+			av_codec_get_max_lowres(m_vidDec->avctx()->codec));
+		if (lowres != m_displayLowres) {
+			// taken at the next keyframe or flush, so a window made larger
+			// gets its resolution back without a seek
+			m_displayLowres = lowres;
+			m_vidDec->setLowres(lowres);
+		}
+	}
+
+	return m_frameConverter->process(frame);
+}
+
 void VideoState::fillRectangle(int x, int y, int w, int h)
 {
 	SDL_Rect rect;
@@ -1128,18 +1463,47 @@ int VideoState::computeMod(int a, int b)
 	return a < 0 ? a%b + b : a%b;
 }
 
-int VideoState::reallocTexture(SDL_Texture ** texture, Uint32 newFormat, int newWidth, int newHeight, SDL_BlendMode blendMode, int initTexture)
+static int64_t textureBytes(Uint32 format, int width, int height)
+{
+	int64_t pixels = static_cast<int64_t>(width) * height;
+	if (SDL_ISPIXELFORMAT_FOURCC(format) && SDL_BYTESPERPIXEL(format) == 1) {
+		// planar 4:2:0
+		return pixels * 3 / 2;
+	}
+	return pixels * SDL_BYTESPERPIXEL(format);
+}
+
+// SDL 2.0.5 has no SDL_UpdateNVTexture. a locked NV texture is the luma
+// plane followed by the interleaved chroma plane
+static int updateNVTexture(SDL_Texture *tex, const AVFrame *frame)
+{
+	uint8_t *pixels;
+	int pitch;
+
+	if (SDL_LockTexture(tex, nullptr, (void **)&pixels, &pitch) < 0) {
+		return -1;
+	}
+	av_image_copy_plane(pixels, pitch, frame->data[0], frame->linesize[0], frame->width, frame->height);
+	av_image_copy_plane(pixels + pitch * frame->height, 2 * ((pitch + 1) / 2), frame->data[1], frame->linesize[1],
+		2 * ((frame->width + 1) / 2), (frame->height + 1) / 2);
+	SDL_UnlockTexture(tex);
+	return 0;
+}
+
+int VideoState::reallocTexture(SDL_Texture ** texture, Uint32 newFormat, int newWidth, int newHeight, SDL_BlendMode blendMode, int initTexture, MemoryGovernor::Scratch scratch)
 {
 	Uint32 format;
 	int access, w, h;
 	if (SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 ||
-		newWidth != h || newFormat != format) {
+		newWidth != w || newHeight != h || newFormat != format) {
 		void *pixels;
 		int pitch;
 		SDL_DestroyTexture(*texture);
+		m_memory.setScratch(scratch, 0);
 		if (!(*texture = SDL_CreateTexture(m_renderer->renderer(), newFormat, SDL_TEXTUREACCESS_STREAMING, newWidth, newHeight))) {
 			return -1;
 		}
+		m_memory.setScratch(scratch, textureBytes(newFormat, newWidth, newHeight));
 		if (SDL_SetTextureBlendMode(*texture, blendMode) < 0) {
 			return -1;
 		}
@@ -1158,8 +1522,8 @@ int VideoState::uploadTexture(SDL_Texture *tex, AVFrame *frame)
 {
 	int ret = 0;
 	
-	switch (frame->format) {
-	case AV_PIX_FMT_YUV420P:
+	switch (textureFormat(frame->format)) {
+	case SDL_PIXELFORMAT_IYUV:
 		if (frame->linesize[0] < 0 || frame->linesize[1] < 0 || frame->linesize[2] < 0) {
 			av_log(nullptr, AV_LOG_ERROR, "Negative linesize is not supported for YUV.\n");
 			return -1;
@@ -1167,28 +1531,25 @@ int VideoState::uploadTexture(SDL_Texture *tex, AVFrame *frame)
 		ret = SDL_UpdateYUVTexture(tex, nullptr, frame->data[0], frame->linesize[0],
 			frame->data[1], frame->linesize[1], frame->data[2], frame->linesize[2]);
 		break;
-	case AV_PIX_FMT_RGBA:
-		if (frame->linesize[0] < 0) {
-			ret = SDL_UpdateTexture(tex, nullptr, frame->data[0] + frame->linesize[0] * (frame->height - 1), -frame->linesize[0]);
-		}
-		else {
-			ret = SDL_UpdateTexture(tex, nullptr, frame->data[0], frame->linesize[0]);
+	case SDL_PIXELFORMAT_NV12:
+	case SDL_PIXELFORMAT_NV21:
+		if (frame->linesize[0] < 0 || frame->linesize[1] < 0) {
+			av_log(nullptr, AV_LOG_ERROR, "Negative linesize is not supported for YUV.\n");
+			return -1;
 		}
+		ret = updateNVTexture(tex, frame);
 		break;
+	case SDL_PIXELFORMAT_UNKNOWN:
+		// queuePicture() converts these
+		av_log(nullptr, AV_LOG_ERROR, "no texture for pixel format %s\n", av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)));
+		return -1;
 	default:
-		bool retVal = m_imgConvertCtx->applyCachedContext(frame->width, frame->height, static_cast<AVPixelFormat>(frame->format), frame->width, frame->height,
-			AV_PIX_FMT_BGRA, s_swsFlags);
-		if (retVal) {
-			uint8_t *pixels[4];
-			int pitch[4];
-			if (!SDL_LockTexture(tex, nullptr, (void**)pixels, pitch)) {
-				m_imgConvertCtx->scale((const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, pixels, pitch);
-				SDL_UnlockTexture(tex);
-			}
+		// packed, a single plane
+		if (frame->linesize[0] < 0) {
+			ret = SDL_UpdateTexture(tex, nullptr, frame->data[0] + frame->linesize[0] * (frame->height - 1), -frame->linesize[0]);
 		}
 		else {
-			av_log(nullptr, AV_LOG_FATAL, "cannot initialize the conversion context\n");
-			ret = -1;
+			ret = SDL_UpdateTexture(tex, nullptr, frame->data[0], frame->linesize[0]);
 		}
 		break;
 	}
@@ -1216,7 +1577,7 @@ void VideoState::displayVideoImage()
 						sp->setHeight(vp->height());
 					}
 
-					if (reallocTexture(&m_subTexture, SDL_PIXELFORMAT_ABGR8888, m_width, m_height, SDL_BLENDMODE_BLEND, 1) < 0) {
+					if (reallocTexture(&m_subTexture, textureFormat(AV_PIX_FMT_BGRA), m_width, m_height, SDL_BLENDMODE_BLEND, 1, MemoryGovernor::SCRATCH_SUBTITLE_TEXTURE) < 0) {
 						return;
 					}
 
@@ -1254,10 +1615,15 @@ void VideoState::displayVideoImage()
 	}
 
 	calculateDisplayRect(&rect, m_xLeft, m_yTop, m_width, m_height, vp->width(), vp->height(), vp->sar());
+	m_displayWidth = rect.w;
+	m_displayHeight = rect.h;
+	if (s_displayDownscale) {
+		m_frameConverter->setTargetSize(rect.w, rect.h);
+	}
 
 	if (!vp->uploaded()) {
-		int sdlPixFmt = vp->frameFormat() == AV_PIX_FMT_YUV420P ? SDL_PIXELFORMAT_YV12 : SDL_PIXELFORMAT_ABGR8888;		
-		if (reallocTexture(&m_vidTexture, sdlPixFmt, vp->frameWidth(), vp->frameHeight(), SDL_BLENDMODE_NONE, 0) < 0) {
+		Uint32 sdlPixFmt = textureFormat(vp->frameFormat());
+		if (reallocTexture(&m_vidTexture, sdlPixFmt, vp->frameWidth(), vp->frameHeight(), SDL_BLENDMODE_NONE, 0, MemoryGovernor::SCRATCH_VIDEO_TEXTURE) < 0) {
 			return;
 		}
 		if (uploadTexture(m_vidTexture, vp->frame()) < 0) {
@@ -1370,18 +1736,20 @@ void VideoState::displayVideoAudio()
 		}
 	}
 	else {
-		if (reallocTexture(&m_visTexture, SDL_PIXELFORMAT_ARGB8888, m_width, m_height, SDL_BLENDMODE_NONE, 1) < 0) {
+		if (reallocTexture(&m_visTexture, SDL_PIXELFORMAT_ARGB8888, m_width, m_height, SDL_BLENDMODE_NONE, 1, MemoryGovernor::SCRATCH_VIS_TEXTURE) < 0) {
 			return;
 		}
 		nbDisplayChannels = FFMIN(nbDisplayChannels, 2);
 		if (rdftBits != m_rdftBits) {
-			av_rdft_end(m_rdft);
+			for (auto &rdft : m_rdft) {
+				av_rdft_end(rdft);
+				rdft = av_rdft_init(rdftBits, DFT_R2C);
+			}
 			av_free(m_rdftData);
-			m_rdft = av_rdft_init(rdftBits, DFT_R2C);
 			m_rdftBits = rdftBits;
 			m_rdftData = static_cast<FFTSample*>(av_malloc_array(nbFreq, 4 * sizeof(*m_rdftData)));
 		}
-		if (!m_rdft || !m_rdftData) {
+		if (!m_rdft[0] || !m_rdft[1] || !m_rdftData) {
 			av_log(nullptr, AV_LOG_ERROR, "Failed to allocate buffers for RDFT, switching to waves display\n");
 			m_showMode = SHOW_MODE_WAVES;
 		}
@@ -1392,8 +1760,11 @@ void VideoState::displayVideoAudio()
 			int pitch;
 			for (ch = 0; ch < nbDisplayChannels; ch++) {
 				data[ch] = m_rdftData + 2 * nbFreq * ch;
-				i = iStart + ch;
-				for (x = 0; x < 2 * nbFreq * ch; x++) {
+			}
+			// the channels are transformed side by side
+			TaskPool::instance().parallelFor(nbDisplayChannels, [&](int ch) {
+				int i = iStart + ch;
+				for (int x = 0; x < 2 * nbFreq; x++) {
 					double w = (x - nbFreq) * (1.0 / nbFreq);
 					data[ch][x] = m_sampleArray[i] * (1.0 - w*w);
 					i += channels;
@@ -1401,8 +1772,8 @@ void VideoState::displayVideoAudio()
 						i -= SAMPLE_ARRAY_SIZE;
 					}
 				}
-				av_rdft_calc(m_rdft, data[ch]);
-			}
+				av_rdft_calc(m_rdft[ch], data[ch]);
+			});
 
 			if (!SDL_LockTexture(m_visTexture, &rect, (void**)&pixels, &pitch)) {
 				pitch >>= 2;
@@ -1494,8 +1865,6 @@ int VideoState::runReadStream()
 	unsigned int origNbStreams;
 	int64_t pktTs;
 
-	Mutex waitMutex;
-
 	memset(stIndex, -1, sizeof(stIndex));
 
 	ic = avformat_alloc_context();
@@ -1583,6 +1952,10 @@ int VideoState::runReadStream()
 
 	// TODO : read function
 	m_realtime = isRealtime(ic, m_filename);
+	if (m_realtime) {
+		// latency matters more than smoothness, the shown picture and one more
+		m_pictureQ.setDepthRange(FrameQueue::VIDEO_PICTURE_QUEUE_MIN, FrameQueue::VIDEO_PICTURE_QUEUE_MIN + 1);
+	}
 
 	if (m_showStatus) {
 		av_dump_format(ic, 0, m_filename, 0);	// what is stream? 
@@ -1656,6 +2029,11 @@ int VideoState::runReadStream()
 	if (s_infiniteBuffer < 0 && m_realtime) {
 		s_infiniteBuffer = 1;
 	}
+	if (s_infiniteBuffer > 0) {
+		m_videoQ.setSpillThreshold(s_spillThreshold);
+		m_audioQ.setSpillThreshold(s_spillThreshold);
+		m_subtitleQ.setSpillThreshold(s_spillThreshold);
+	}
 
 	for (;;) {
 		if (m_abortRequest) {
@@ -1685,33 +2063,39 @@ int VideoState::runReadStream()
 			// FIXME the +-2 is due to rounding being not done in the correct direction in generation
 			//      of the seek_pos/seek_rel variables
 
-			ret = avformat_seek_file(m_ic, -1, seekMin, seekTarget, seekMax, m_seekFlags);
-			if (ret < 0) {
-				av_log(nullptr, AV_LOG_ERROR, "%s: error while seeking\n", m_filename);
+			if (seekInBuffer(seekMin, seekTarget)) {
+				av_log(nullptr, AV_LOG_DEBUG, "seek to %0.3f served from the packet queues\n", seekTarget / (double)AV_TIME_BASE);
+				m_extClk.setClock(seekTarget / (double)AV_TIME_BASE, 0);
 			}
 			else {
-				if (m_audioStream >= 0) {
-					m_audioQ.flush();
-					m_audioQ.putFlushPkt();
-				}
-				if (m_subtitleStream >= 0) {
-					m_subtitleQ.flush();
-					m_subtitleQ.putFlushPkt();
-				}
-				if (m_videoStream >= 0) {
-					m_videoQ.flush();
-					m_videoQ.putFlushPkt();
-				}
-				if (m_seekFlags & AVSEEK_FLAG_BYTE) {
-					m_extClk.setClock(NAN, 0);
+				ret = avformat_seek_file(m_ic, -1, seekMin, seekTarget, seekMax, m_seekFlags);
+				if (ret < 0) {
+					av_log(nullptr, AV_LOG_ERROR, "%s: error while seeking\n", m_filename);
 				}
 				else {
-					m_extClk.setClock(seekTarget / (double)AV_TIME_BASE, 0);
+					if (m_audioStream >= 0) {
+						m_audioQ.flush();
+						m_audioQ.putFlushPkt();
+					}
+					if (m_subtitleStream >= 0) {
+						m_subtitleQ.flush();
+						m_subtitleQ.putFlushPkt();
+					}
+					if (m_videoStream >= 0) {
+						m_videoQ.flush();
+						m_videoQ.putFlushPkt();
+					}
+					if (m_seekFlags & AVSEEK_FLAG_BYTE) {
+						m_extClk.setClock(NAN, 0);
+					}
+					else {
+						m_extClk.setClock(seekTarget / (double)AV_TIME_BASE, 0);
+					}
 				}
+				m_eof = 0;
 			}
 			m_seekReq = 0;
 			m_queueAttachmentsReq = 1;
-			m_eof = 0;
 			if (m_paused) {
 				stepToNextFrame();
 			}
@@ -1729,35 +2113,19 @@ int VideoState::runReadStream()
 			m_queueAttachmentsReq = 0;
 		}
 
-		const int MAX_QUEUE_SIZE = 15 * 1024 * 1024;
-		//int level = av_log_get_level();
-		//av_log_set_level(AV_LOG_DEBUG);
-		//av_log(nullptr, AV_LOG_DEBUG, "AQ : %d, VQ : %d, SQ : %d\n", m_audioQ.size(), m_videoQ.size(), m_subtitleQ.size());
-		//av_log(nullptr, AV_LOG_DEBUG, "AQE : %d, VQE : %d, SQE : %d\n", m_audioQ.hasEnoughPackets(m_audioSt, m_audioStream), 
-		//m_videoQ.hasEnoughPackets(m_videoSt, m_videoStream), 
-		//m_subtitleQ.hasEnoughPackets(m_subtitleSt, m_subtitleStream));
-		//av_log_set_level(level);
-		if (s_infiniteBuffer < 1 &&
-			(m_audioQ.size() + m_videoQ.size() + m_subtitleQ.size() > MAX_QUEUE_SIZE ||
-			(m_audioQ.hasEnoughPackets(m_audioSt, m_audioStream) &&
-				m_videoQ.hasEnoughPackets(m_videoSt, m_videoStream) &&
-				m_subtitleQ.hasEnoughPackets(m_subtitleSt, m_subtitleStream)))) {
-
-			waitMutex.lock();
-			m_condReadThread->waitTimeout(waitMutex, 10);
-			waitMutex.unlock();
+		if (s_infiniteBuffer < 1 && queuesAreFull()) {
+			// the decoders wake us up as soon as they free enough space
+			m_continueReadThread->wait([this] { return hasReadRequest() || !queuesAreFull(); });
 			continue;
 		}
 
-		if (!m_paused &&
-			(!m_audioSt || m_audioQ.isSameSerial(m_audDec->finished() && m_sampleQ.remaining() == 0)) &&
-			(!m_videoSt || m_videoQ.isSameSerial(m_vidDec->finished() && m_pictureQ.remaining() == 0))) {
+		if (!m_paused && isDrained()) {
 			if (s_loop != 1 && (!s_loop || --s_loop)) {
 				seekStream(m_startTime != AV_NOPTS_VALUE ? m_startTime : 0, 0, 0);
 			}
-			else if (s_autoexit) {
+			else if (s_autoexit || m_nullSink) {
 				ret = AVERROR_EOF;
-				// handle exception
+				goto fail;
 			}
 		}
 		ret = av_read_frame(ic, pkt);
@@ -1777,12 +2145,24 @@ int VideoState::runReadStream()
 			if (ic->pb && ic->pb->error) {
 				break;
 			}
-			waitMutex.lock();
-			m_condReadThread->waitTimeout(waitMutex, 10);
-			waitMutex.unlock();
+			if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !m_realtime) {
+				// nothing to read until a seek, a pause toggle or the end of playback
+				bool waitDrain = s_loop != 1 || s_autoexit || m_nullSink;
+				m_continueReadThread->wait([this, waitDrain] {
+					return hasReadRequest() || (waitDrain && !m_paused && isDrained());
+				});
+			}
+			else {
+				// live sources and transient errors are retried
+				m_continueReadThread->waitTimeout([this] { return hasReadRequest(); }, 10);
+			}
+			continue;
 		}
 		else {
 			m_eof = 0;
+			m_nbReadPackets++;
+			m_readStage.count();
+			m_readThreadStats.tick();
 		}
 
 		streamStartTime = ic->streams[pkt->stream_index]->start_time;
@@ -1811,6 +2191,11 @@ fail:
 		avformat_close_input(&ic);
 	}
 
+	if (m_nullSink) {
+		closeNullSinks();
+		printBenchmarkReport();
+	}
+
 	if (ret != 0) {
 		SDL_Event event;
 
@@ -1819,7 +2204,143 @@ fail:
 		SDL_PushEvent(&event);
 	}
 
-	//SDL_DestroyMutex(waitMutex);
+	return 0;
+}
+
+static int64_t toStreamTimestamp(AVStream *st, int64_t ts)
+{
+	return av_rescale_q_rnd(ts, AV_TIME_BASE_Q, st->time_base,
+		static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX));
+}
+
+// moves every queue to the seek target without touching the demuxer, when
+// the queued packets already cover it
+bool VideoState::seekInBuffer(int64_t seekMin, int64_t seekTarget)
+{
+	unsigned int videoIndex = 0;
+	unsigned int audioIndex = 0;
+
+	if ((m_seekFlags & AVSEEK_FLAG_BYTE) ||
+		(m_videoSt && (m_videoSt->disposition & AV_DISPOSITION_ATTACHED_PIC))) {
+		return false;
+	}
+
+	if (m_videoStream >= 0 &&
+		!m_videoQ.findSeekPoint(toStreamTimestamp(m_videoSt, seekMin), toStreamTimestamp(m_videoSt, seekTarget), &videoIndex)) {
+		return false;
+	}
+	if (m_audioStream >= 0 &&
+		!m_audioQ.findSeekPoint(toStreamTimestamp(m_audioSt, seekMin), toStreamTimestamp(m_audioSt, seekTarget), &audioIndex)) {
+		return false;
+	}
+
+	if (m_videoStream >= 0) {
+		m_videoQ.skipTo(videoIndex);
+	}
+	if (m_audioStream >= 0) {
+		m_audioQ.skipTo(audioIndex);
+	}
+	if (m_subtitleStream >= 0) {
+		m_subtitleQ.skipTo(m_subtitleQ.findFirstAfter(toStreamTimestamp(m_subtitleSt, seekTarget)));
+	}
+	return true;
+}
+
+bool VideoState::hasReadRequest() const
+{
+	return m_abortRequest || m_seekReq || m_queueAttachmentsReq || m_paused != m_lastPaused;
+}
+
+bool VideoState::queuesAreFull()
+{
+	// in the order the streams were added to m_memory
+	bool hasEnough[] = {
+		m_audioQ.hasEnoughPackets(m_audioSt, m_audioStream, s_minQueueDuration) != 0,
+		m_videoQ.hasEnoughPackets(m_videoSt, m_videoStream, s_minQueueDuration) != 0,
+		m_subtitleQ.hasEnoughPackets(m_subtitleSt, m_subtitleStream, s_minQueueDuration) != 0
+	};
+	// buffers the decoder holds and the idle ones aren't in any queue.
+	// pictures queued in their decoded buffers count twice, on the safe side
+	m_memory.setScratch(MemoryGovernor::SCRATCH_FRAME_POOL, m_videoFramePool->pinnedBytes());
+	return m_memory.isFull(hasEnough) || (hasEnough[0] && hasEnough[1] && hasEnough[2]);
+}
+
+bool VideoState::isDrained() const
+{
+	return (!m_audioSt || (m_audioQ.isSameSerial(m_audDec->finished()) && m_sampleQ.remaining() == 0)) &&
+		(!m_videoSt || (m_videoQ.isSameSerial(m_vidDec->finished()) && m_pictureQ.remaining() == 0));
+}
+
+void VideoState::closeNullSinks()
+{
+	m_pipeline.stop();
+}
+
+void VideoState::printBenchmarkReport()
+{
+	PipelineGraph::Node nodes[PipelineGraph::MAX_STAGES];
+	int nbNodes = m_pipeline.nodes(nodes);
+	double wallTime;
+	int64_t nbVideoFrames = m_videoSink ? m_videoSink->nbFrames() : 0;
+	int64_t nbAudioFrames = m_audioSink ? m_audioSink->nbFrames() : 0;
+
+	m_readThreadStats.update();
+	wallTime = FFMAX(m_readThreadStats.wallTime(), 1e-6);
+
+	av_log(nullptr, AV_LOG_INFO, "\nnull sink benchmark: %s\n", m_filename);
+	av_log(nullptr, AV_LOG_INFO, "  wall %.3fs, packets %" PRId64 " (%.1f/s)\n",
+		wallTime, m_nbReadPackets, m_nbReadPackets / wallTime);
+	av_log(nullptr, AV_LOG_INFO, "  video frames %" PRId64 " (%.2f fps), audio frames %" PRId64 " (%.2f fps)\n",
+		nbVideoFrames, nbVideoFrames / wallTime, nbAudioFrames, nbAudioFrames / wallTime);
+	av_log(nullptr, AV_LOG_INFO, "  %-8s %-10s %-8s %10s %10s %10s %10s %10s %10s %10s\n", "stage", "kind", "input",
+		"processed", "wall(s)", "cpu(s)", "cpu(%)", "wakeups", "vcsw", "ivcsw");
+	for (int i = 0; i < nbNodes; i++) {
+		const Stage &stage = *nodes[i].stage;
+		const ThreadStats *stats = stage.threadStats();
+		if (!stats) {
+			continue;
+		}
+		av_log(nullptr, AV_LOG_INFO, "  %-8s %-10s %-8s %10" PRId64 " %10.3f %10.3f %10.1f %10" PRId64 " %10" PRId64 " %10" PRId64 "\n",
+			stage.name(), Stage::kindName(stage.kind()), nodes[i].upstream ? nodes[i].upstream->name() : "-",
+			stage.nbProcessed(), stats->wallTime(), stats->cpuTime(), stats->cpuLoad(),
+			stats->wakeups(), stats->voluntarySwitches(), stats->involuntarySwitches());
+	}
+
+	struct {
+		const char *name;
+		const PacketQueue &queue;
+		const FrameQueue &frames;
+		int streamIndex;
+	} queues[] = {
+		{ "aq", m_audioQ, m_sampleQ, m_audioStream },
+		{ "vq", m_videoQ, m_pictureQ, m_videoStream },
+		{ "sq", m_subtitleQ, m_subPictureQ, m_subtitleStream },
+	};
+	av_log(nullptr, AV_LOG_INFO, "  %-8s %10s %10s %10s %10s %10s %10s\n", "queue", "slots", "peak", "get/batch", "push/batch", "spill(MB)", "depth");
+	for (auto &q : queues) {
+		if (q.streamIndex >= 0) {
+			av_log(nullptr, AV_LOG_INFO, "  %-8s %10d %10d %10.2f %10.2f %10.1f %6d/%-3d\n",
+				q.name, q.queue.allocatedSlots(), q.queue.highWaterPackets(),
+				q.queue.averageGetBatch(), q.frames.averagePushBatch(),
+				q.queue.peakSpilledSize() / (1024.0 * 1024.0),
+				q.frames.depth(), q.frames.peakDepth());
+		}
+	}
+	av_log(nullptr, AV_LOG_INFO, "  memory peak %.1fMB (packets %.1fMB, frames %.1fMB, scratch %.1fMB at exit)\n",
+		m_memory.peakTotalBytes() / (1024.0 * 1024.0), m_memory.packetBytes() / (1024.0 * 1024.0),
+		m_memory.frameBytes() / (1024.0 * 1024.0), m_memory.scratchBytes() / (1024.0 * 1024.0));
+	if (m_videoStream >= 0) {
+		av_log(nullptr, AV_LOG_INFO, "  frame pool %d buffers, %.1fMB pinned\n",
+			m_videoFramePool->nbBuffers(), m_videoFramePool->pinnedBytes() / (1024.0 * 1024.0));
+	}
+}
+
+// called from whichever thread pushes the event
+int SDLCALL VideoState::eventWatch(void * userdata, SDL_Event * /*event*/)
+{
+	VideoState *is = static_cast<VideoState *>(userdata);
+	is->m_eventPending = true;
+	is->m_refreshNotifier->notify();
 	return 0;
 }
 
@@ -1885,6 +2406,13 @@ void VideoState::handleAudioCallback(Uint8 *stream, unsigned int len)
 void VideoState::sdlAudioCallback(void * opaque, Uint8 * stream, int len)
 {
 	VideoState *is = static_cast<VideoState *>(opaque);
+	// the device thread belongs to SDL, an underrun is audible so it goes first
+	if (!is->m_audioCallbackTime) {
+		Thread::applyPolicy("audioCallback", threadPolicy(s_audioCpuMask, s_audioNice, s_audioRealtime != 0));
+		is->m_audioCallbackStats.begin();
+		is->m_audioOutStage.setRunning();
+	}
+	is->m_audioCallbackStats.wakeUp();
 	is->handleAudioCallback(stream, len);
 }
 
@@ -1900,14 +2428,22 @@ int VideoState::runAudioDecoding()
 	int gotFrame = 0;
 	AVRational tb;
 	int ret = 0;
+	int pending = 0;	// frames written to m_sampleQ but not pushed yet
 
 	if (!frame) {
 		return AVERROR(ENOMEM);
 	}
 
 	do {
-		if ((gotFrame = m_audDec->decodeFrame(frame, nullptr)) < 0) {
-			// TODO : throw exception
+		// frames are pushed in batches, but never held back while waiting for packets
+		gotFrame = m_audDec->decodeFrame(frame, nullptr, !pending);
+		if (gotFrame == AVERROR(EAGAIN)) {
+			m_sampleQ.push(pending);
+			pending = 0;
+			continue;
+		}
+		if (gotFrame < 0) {
+			goto the_end;
 		}
 
 		if (gotFrame) {
@@ -1946,15 +2482,19 @@ int VideoState::runAudioDecoding()
 			while ((ret = av_buffersink_get_frame_flags(m_outAudioFilter, frame, 0)) >= 0) {
 				tb = av_buffersink_get_time_base(m_outAudioFilter);
 #endif
-				if (!(af = m_sampleQ.peekWritable())) {
-					// TODO : throw exception
+				if (!pending && !m_sampleQ.waitWritable(AUDIO_FRAME_BATCH)) {
+					goto the_end;
 				}
+				af = m_sampleQ.writable(pending);
 
 				af->setPosInfo((frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb),
 					frame->pkt_pos, m_audDec->pktSerial(),
 					av_q2d(AVRational{ frame->nb_samples, frame->sample_rate }));
 				af->moveRef(frame);
-				m_sampleQ.push();
+				if (++pending == AUDIO_FRAME_BATCH) {
+					m_sampleQ.push(pending);
+					pending = 0;
+				}
 
 #if CONFIG_AVFILTER
 			}
@@ -1963,6 +2503,10 @@ int VideoState::runAudioDecoding()
 			}
 #endif
 		}
+		else if (pending) {
+			m_sampleQ.push(pending);
+			pending = 0;
+		}
 	} while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
 
 the_end:
@@ -2098,4 +2642,148 @@ int VideoState::subTitleThread(void * arg)
 {
 	VideoState *is = static_cast<VideoState*>(arg);
 	return is->runSubtitleDecoding();
-}
\ No newline at end of file
+}
+
+// runAudioDecoding() cut where it would block: before decoding when the
+// next batch has no room, and when no packet is queued
+ResumableJob::Result VideoState::resumeAudioDecoding()
+{
+	Frame *af;
+	int gotFrame;
+
+	if (!m_audioJobFrame && !(m_audioJobFrame = av_frame_alloc())) {
+		return ResumableJob::RESULT_DONE;
+	}
+
+	for (int i = 0; i < RESUME_BATCH; i++) {
+		if (m_audioQ.isAbortRequested()) {
+			goto the_end;
+		}
+		if (!m_audioJobPending && !m_sampleQ.isWritable(AUDIO_FRAME_BATCH)) {
+			return ResumableJob::RESULT_SUSPEND;
+		}
+
+		gotFrame = m_audDec->decodeFrame(m_audioJobFrame, nullptr, 0);
+		if (gotFrame == AVERROR(EAGAIN)) {
+			m_sampleQ.push(m_audioJobPending);
+			m_audioJobPending = 0;
+			return ResumableJob::RESULT_SUSPEND;
+		}
+		if (gotFrame < 0) {
+			goto the_end;
+		}
+
+		if (gotFrame) {
+			AVFrame *frame = m_audioJobFrame;
+			AVRational tb = AVRational{ 1, frame->sample_rate };
+
+			af = m_sampleQ.writable(m_audioJobPending);
+			af->setPosInfo((frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb),
+				frame->pkt_pos, m_audDec->pktSerial(),
+				av_q2d(AVRational{ frame->nb_samples, frame->sample_rate }));
+			af->moveRef(frame);
+			if (++m_audioJobPending == AUDIO_FRAME_BATCH) {
+				m_sampleQ.push(m_audioJobPending);
+				m_audioJobPending = 0;
+			}
+		}
+		else if (m_audioJobPending) {
+			m_sampleQ.push(m_audioJobPending);
+			m_audioJobPending = 0;
+		}
+	}
+	return ResumableJob::RESULT_YIELD;
+
+the_end:
+	av_frame_free(&m_audioJobFrame);
+	return ResumableJob::RESULT_DONE;
+}
+
+ResumableJob::Result VideoState::resumeVideoDecoding()
+{
+	AVRational tb = m_videoSt->time_base;
+	AVRational frameRate = av_guess_frame_rate(m_ic, m_videoSt, nullptr);
+	double pts;
+	double duration;
+	int ret;
+
+	if (!m_videoJobFrame && !(m_videoJobFrame = av_frame_alloc())) {
+		return ResumableJob::RESULT_DONE;
+	}
+
+	for (int i = 0; i < RESUME_BATCH; i++) {
+		if (m_videoQ.isAbortRequested()) {
+			goto the_end;
+		}
+		if (!m_pictureQ.isWritable(1)) {
+			return ResumableJob::RESULT_SUSPEND;
+		}
+
+		ret = getVideoFrame(m_videoJobFrame, 0);
+		if (ret == AVERROR(EAGAIN)) {
+			return ResumableJob::RESULT_SUSPEND;
+		}
+		if (ret < 0) {
+			goto the_end;
+		}
+		if (!ret) {
+			continue;
+		}
+
+		duration = (frameRate.num && frameRate.den ? av_q2d(AVRational{ frameRate.den, frameRate.num }) : 0);
+		pts = (m_videoJobFrame->pts == AV_NOPTS_VALUE) ? NAN : m_videoJobFrame->pts * av_q2d(tb);
+		ret = queuePicture(m_videoJobFrame, pts, duration, av_frame_get_pkt_pos(m_videoJobFrame), m_vidDec->pktSerial());
+		av_frame_unref(m_videoJobFrame);
+		if (ret < 0) {
+			goto the_end;
+		}
+	}
+	return ResumableJob::RESULT_YIELD;
+
+the_end:
+	av_frame_free(&m_videoJobFrame);
+	return ResumableJob::RESULT_DONE;
+}
+
+ResumableJob::Result VideoState::resumeSubtitleDecoding()
+{
+	Frame *sp;
+	int gotSubtitle;
+	double pts;
+
+	for (int i = 0; i < RESUME_BATCH; i++) {
+		if (m_subtitleQ.isAbortRequested()) {
+			return ResumableJob::RESULT_DONE;
+		}
+		if (!m_subPictureQ.isWritable(1)) {
+			return ResumableJob::RESULT_SUSPEND;
+		}
+
+		sp = m_subPictureQ.writable(0);
+		gotSubtitle = m_subDec->decodeFrame(nullptr, sp->sub(), 0);
+		if (gotSubtitle == AVERROR(EAGAIN)) {
+			return ResumableJob::RESULT_SUSPEND;
+		}
+		if (gotSubtitle < 0) {
+			return ResumableJob::RESULT_DONE;
+		}
+
+		pts = 0;
+
+		if (gotSubtitle && sp->subFormat() == 0) {
+			if (sp->subPts() != AV_NOPTS_VALUE) {
+				pts = sp->subPts() / (double)AV_TIME_BASE;
+			}
+			sp->setPts(pts);
+			sp->setSerial(m_subDec->pktSerial());
+			sp->setAreaInfo(m_subDec->avctx()->width,
+				m_subDec->avctx()->height);
+			sp->setUploaded(0);
+			m_subPictureQ.push();
+		}
+		else if (gotSubtitle) {
+			avsubtitle_free(sp->sub());
+		}
+	}
+	return ResumableJob::RESULT_YIELD;
+}
@@ -10,7 +10,15 @@ extern "C" {
 }
 #include "PacketQueue.h"
 #include "FrameQueue.h"
+#include "ThreadStats.h"
+#include "MemoryGovernor.h"
+#include "PipelineGraph.h"
+#include "ResumableJob.h"
+#include "DecoderScheduler.h"
 #include <memory>
+#include <atomic>
+
+#define FF_QUIT_EVENT    (SDL_USEREVENT + 2)
 
 struct SDL_cond;
 struct SDL_Window;
@@ -22,9 +30,12 @@ struct SwrContext;
 class Renderer;
 class Window;
 class Thread;
-class Condition;
+class Notifier;
 class SwScaleContext;
 class SwResampleContext;
+class NullSink;
+class FramePool;
+class FrameConverter;
 
 // TODO : make this into class
 struct AudioParams {
@@ -39,7 +50,9 @@ struct AudioParams {
 class VideoState
 {
 public:
-	VideoState(const char *filename, AVInputFormat *iformat);
+	// the priority weighs the video decoder against those of the other
+	// instances when the cores are shared out, see DecoderScheduler
+	VideoState(const char *filename, AVInputFormat *iformat, bool nullSink = false, int decoderPriority = DecoderScheduler::PRIORITY_NORMAL);
 	~VideoState();
 
 public:
@@ -65,6 +78,14 @@ private:
 		SDL_AUDIO_MIN_BUFFER_SIZE = 512
 	};
 
+	enum {
+		AUDIO_FRAME_BATCH = 4
+	};
+
+	enum {
+		LATE_FRAMES_BEFORE_GOP_SKIP = 8
+	};
+
 	static const float AV_NOSYNC_THRESHOLD;
 	
 	enum {
@@ -88,6 +109,8 @@ public:
 	void toggleStreamPause();
 	void refreshLoopWaitEvent(SDL_Event &event);
 
+	const PipelineGraph &pipeline() const { return m_pipeline; }
+
 private:
 	int openStreamComponent(int streamIndex);
 	int openAudio(int64_t wantedChannelLayout, int wantedNbChannels, int wantedSampleRate, AudioParams &audioHwParams);
@@ -98,16 +121,18 @@ private:
 	int audioDecodeFrame();
 	void seekStream(int64_t pos, int64_t rel, int seekByBytes);
 	void refreshVideo(double &remainingTime);
+	void waitForDeadline(double deadline, bool needPicture);
 	void checkExternalClockSpeed();
 	double vpDuration(Frame *vp, Frame *nextVp);
 	double computeTargetDelay(double delay);
 	void updateVideoPts(double pts, int64_t pos, int serial);
-	int getVideoFrame(AVFrame *frame);
+	int getVideoFrame(AVFrame *frame, int block = 1);
 	int queuePicture(AVFrame *srcFrame, double pts, double duration, int64_t pos, int serial);
+	int prepareForDisplay(AVFrame *frame);
 	void displayVideoAudio();
 	void fillRectangle(int x, int y, int w, int h);
 	int computeMod(int a, int b);
-	int reallocTexture(SDL_Texture **texture, Uint32 newFormat, int newWidth, int newHeight, SDL_BlendMode blendMode, int initTexture);
+	int reallocTexture(SDL_Texture **texture, Uint32 newFormat, int newWidth, int newHeight, SDL_BlendMode blendMode, int initTexture, MemoryGovernor::Scratch scratch);
 	void displayVideoImage();
 	int uploadTexture(SDL_Texture *tex, AVFrame *frame);
 	int runReadStream();
@@ -115,6 +140,15 @@ private:
 	int runAudioDecoding();
 	int runVideoDecoding();
 	int runSubtitleDecoding();
+	ResumableJob::Result resumeAudioDecoding();
+	ResumableJob::Result resumeVideoDecoding();
+	ResumableJob::Result resumeSubtitleDecoding();
+	bool seekInBuffer(int64_t seekMin, int64_t seekTarget);
+	bool hasReadRequest() const;
+	bool queuesAreFull();
+	bool isDrained() const;
+	void closeNullSinks();
+	void printBenchmarkReport();
 
 private:
 	static int readThread(void *arg);
@@ -123,15 +157,23 @@ private:
 	static int audioThread(void *arg);
 	static int videoThread(void *arg);
 	static int subTitleThread(void *arg);
+	static int SDLCALL eventWatch(void *userdata, SDL_Event *event);
 	
 private:	// members should be zero on creating
 	const char* m_filename = nullptr;
+	int m_decoderPriority = DecoderScheduler::PRIORITY_NORMAL;
 	const char* m_windowTitle = nullptr;
 	AVInputFormat *m_iFormat = nullptr;
+	bool m_nullSink = false;
 	int m_width = 0;
 	int m_height = 0;
 	int m_xLeft = 0;
 	int m_yTop = 0;
+	// size of the picture on screen, written by the render thread
+	std::atomic<int> m_displayWidth{ 0 };
+	std::atomic<int> m_displayHeight{ 0 };
+	// the lowres last asked of the video decoder for that size
+	int m_displayLowres = 0;
 
 	AVFormatContext *m_ic = nullptr;
 
@@ -143,7 +185,14 @@ private:	// members should be zero on creating
 	FrameQueue m_subPictureQ;
 	FrameQueue m_sampleQ;
 
-	std::unique_ptr<Condition> m_condReadThread;
+	MemoryGovernor m_memory;
+
+	std::unique_ptr<Notifier> m_continueReadThread;
+	// wakes resumable decoders up when packets arrive
+	std::unique_ptr<Notifier> m_packetsQueued;
+	// wakes the refresh loop up before its deadline
+	std::unique_ptr<Notifier> m_refreshNotifier;
+	std::atomic<bool> m_eventPending{ false };
 
 	Clock m_audClk;
 	Clock m_vidClk;
@@ -154,6 +203,14 @@ private:	// members should be zero on creating
 	
 	int m_avSyncType = AV_SYNC_AUDIO_MASTER;
 
+	ThreadStats m_readThreadStats;
+	ThreadStats m_renderStats;
+	ThreadStats m_audioCallbackStats;
+	// stages run by the read loop, the audio callback and the refresh loop
+	ExternalStage m_readStage;
+	ExternalStage m_audioOutStage;
+	ExternalStage m_displayStage;
+	PipelineGraph m_pipeline;
 	std::unique_ptr<Thread> m_readThread;
 
 	AVStream *m_audioSt = nullptr;
@@ -197,6 +254,8 @@ private:	// members should be zero on creating
 
 	int m_frameDropsEarly = 0;
 	int m_frameDropsLate = 0;
+	int m_lateFrames = 0;	// decoded too late in a row
+	int m_gopSkips = 0;
 
 	static int m_genPts;
 	static int m_seekByBytes;
@@ -250,7 +309,8 @@ private:	// members should be zero on creating
 	int m_lastIStart = 0;
 
 	int m_rdftBits = 0;
-	RDFTContext *m_rdft = nullptr;
+	// one per displayed channel, a context can only transform one buffer at a time
+	RDFTContext *m_rdft[2] = { nullptr, nullptr };
 	FFTSample *m_rdftData = nullptr;
 
 	SDL_Texture *m_visTexture = nullptr;
@@ -259,7 +319,8 @@ private:	// members should be zero on creating
 	int m_xPos = 0;
 
 	std::unique_ptr<SwScaleContext> m_subConvertCtx;
-	std::unique_ptr<SwScaleContext> m_imgConvertCtx;
+	// decoded pictures to the texture format, on the video decoder thread
+	std::unique_ptr<FrameConverter> m_frameConverter;
 
 	std::unique_ptr<SwResampleContext> m_swResampleCtx;
 	double m_audioDiffCum;
@@ -267,12 +328,24 @@ private:	// members should be zero on creating
 	unsigned int m_audioBuf1Size = 0;
 	uint8_t *m_audioBuf1 = nullptr;
 
+	// outlives the video decoders that allocate from it, each video stream
+	// opened attaches to it. sized after the depth of m_pictureQ
+	std::unique_ptr<FramePool> m_videoFramePool;
+	// state a resumable decoder keeps between two steps
+	AVFrame *m_audioJobFrame = nullptr;
+	AVFrame *m_videoJobFrame = nullptr;
+	int m_audioJobPending = 0;
 	std::unique_ptr<Decoder> m_audDec;
 	std::unique_ptr<Decoder> m_vidDec;
 	std::unique_ptr<Decoder> m_subDec;	
 
 	std::unique_ptr<Renderer> m_renderer;
 	std::unique_ptr<Window> m_window;
+
+	int64_t m_nbReadPackets = 0;
+	std::unique_ptr<NullSink> m_audioSink;
+	std::unique_ptr<NullSink> m_videoSink;
+	std::unique_ptr<NullSink> m_subtitleSink;
 };
 
 #endif
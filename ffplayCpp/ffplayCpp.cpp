@@ -7,6 +7,7 @@
 #endif
 
 #include <signal.h>
+#include <string.h>
 
 extern "C" {
 #include <libavutil/opt.h>
@@ -23,7 +24,8 @@ extern "C" {
 #include <thread>
 #include <chrono>
 
-FfPlayCpp::FfPlayCpp()
+FfPlayCpp::FfPlayCpp(bool nullSink) :
+	m_nullSink(nullSink)
 {
 	init();
 }
@@ -35,7 +37,7 @@ FfPlayCpp::~FfPlayCpp()
 
 void FfPlayCpp::openStream(const char * inputFile, AVInputFormat * inputFormat)
 {
-	m_videoState = new VideoState(inputFile, inputFormat);
+	m_videoState = new VideoState(inputFile, inputFormat, m_nullSink);
 }
 
 void FfPlayCpp::eventLoop()
@@ -50,7 +52,7 @@ void FfPlayCpp::eventLoop()
 		m_videoState->refreshLoopWaitEvent(event);
 		switch (event.type) {
 		case SDL_QUIT:
-		//case FF_QUIT_EVENT:
+		case FF_QUIT_EVENT:
 			doExit(m_videoState);
 			break;
 		default:
@@ -96,6 +98,10 @@ void FfPlayCpp::initSDL()
 {
 	int flags;
 	flags = SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER;
+	if (m_nullSink) {
+		// no window and no audio device, only the event queue for quitting
+		flags = SDL_INIT_EVENTS | SDL_INIT_TIMER;
+	}
 
 	if (!SDL_getenv("SDL_AUDIO_ALSA_SET_BUFFER_SIZE")) {
 		SDL_setenv("SDL_AUDIO_ALSA_SET_BUFFER_SIZE", "1", 1);
@@ -179,12 +185,21 @@ static void show_help_demuxer()
 
 int main(int argc, char *args[])
 {
-	FfPlayCpp app;
+	bool nullSink = false;
 #ifdef _WIN32
 	const char* inputFile = "D:/video/your_free_time_subtitle.avi";
 #else
 	const char* inputFile = "samplevideo.mp4";
 #endif
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(args[i], "-nullsink")) {
+			nullSink = true;
+		}
+		else {
+			inputFile = args[i];
+		}
+	}
+	FfPlayCpp app(nullSink);
 	//const char* inputFile = "D:/video/TheGirlWithTheDragonTattoo2009.sample.mkv";
 	//const char* inputFile = "http://169.56.73.204/hls/test.m3u8";
 	AVInputFormat *inputFormat = NULL;